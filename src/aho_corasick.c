@@ -0,0 +1,254 @@
+#include "aho_corasick.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "find.h"
+
+// The trie as it is being built, before it is laid out for searching.
+struct trie_node
+{
+  int child;   // First child, or -1.
+  int sibling; // Next child of the same parent, or -1.
+  int id;
+  unsigned char byte;
+};
+
+static void *ac_alloc(size_t size)
+{
+  void *p = malloc(size);
+  if (p == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  return p;
+}
+
+static int trie_insert(struct trie_node **trie, int *num_nodes, int *cap, const char *pattern,
+                       const unsigned char *fold)
+{
+  int u = 0;
+
+  for (const char *p = pattern; *p != '\0'; p++)
+  {
+    unsigned char c = fold[(unsigned char)*p];
+    int v = (*trie)[u].child;
+    while (v >= 0 && (*trie)[v].byte != c)
+    {
+      v = (*trie)[v].sibling;
+    }
+
+    if (v < 0)
+    {
+      if (*num_nodes == *cap)
+      {
+        *cap *= 2;
+        if ((*trie = realloc(*trie, *cap * sizeof(struct trie_node))) == NULL)
+        {
+          err(1, "realloc() failed");
+        }
+      }
+      v = (*num_nodes)++;
+      (*trie)[v].child = -1;
+      (*trie)[v].sibling = (*trie)[u].child;
+      (*trie)[v].id = -1;
+      (*trie)[v].byte = c;
+      (*trie)[u].child = v;
+    }
+
+    u = v;
+  }
+
+  return u;
+}
+
+static inline int ac_step(const struct aho_corasick *ac, int s, unsigned char c)
+{
+  while (s != 0)
+  {
+    const struct aho_corasick_node *n = &ac->nodes[s];
+    for (int k = n->first_child; k < n->first_child + n->num_children; k++)
+    {
+      if (ac->edge_bytes[k] == c)
+      {
+        return k;
+      }
+    }
+    s = n->fail;
+  }
+  return ac->root[c];
+}
+
+void aho_corasick_init(struct aho_corasick *ac, char *const *patterns, int num_patterns,
+                       int nocase)
+{
+  for (int c = 0; c < 256; c++)
+  {
+    ac->fold[c] = nocase ? fold_byte(c) : c;
+  }
+
+  ac->num_patterns = num_patterns;
+  ac->pattern_len = ac_alloc(num_patterns * sizeof(size_t));
+  ac->next_id = ac_alloc(num_patterns * sizeof(int));
+
+  int num_nodes = 1;
+  int cap = 64;
+  struct trie_node *trie = ac_alloc(cap * sizeof(struct trie_node));
+  trie[0].child = -1;
+  trie[0].sibling = -1;
+  trie[0].id = -1;
+
+  for (int i = 0; i < num_patterns; i++)
+  {
+    int u = trie_insert(&trie, &num_nodes, &cap, patterns[i], ac->fold);
+    ac->pattern_len[i] = strlen(patterns[i]);
+    ac->next_id[i] = -1;
+
+    // Keep equal needles in the order they were given.
+    if (trie[u].id < 0)
+    {
+      trie[u].id = i;
+    }
+    else
+    {
+      int j = trie[u].id;
+      while (ac->next_id[j] >= 0)
+      {
+        j = ac->next_id[j];
+      }
+      ac->next_id[j] = i;
+    }
+  }
+
+  // Lay the trie out in breadth-first order.  'order' maps new numbers
+  // to old ones.
+  int *order = ac_alloc(num_nodes * sizeof(int));
+  ac->num_nodes = num_nodes;
+  ac->nodes = ac_alloc(num_nodes * sizeof(struct aho_corasick_node));
+  ac->edge_bytes = ac_alloc(num_nodes);
+
+  order[0] = 0;
+  ac->edge_bytes[0] = 0;
+  int tail = 1;
+  for (int u = 0; u < num_nodes; u++)
+  {
+    struct aho_corasick_node *n = &ac->nodes[u];
+    n->id = trie[order[u]].id;
+    n->first_child = tail;
+    for (int v = trie[order[u]].child; v >= 0; v = trie[v].sibling)
+    {
+      ac->edge_bytes[tail] = trie[v].byte;
+      order[tail++] = v;
+    }
+    n->num_children = tail - n->first_child;
+  }
+
+  free(order);
+  free(trie);
+
+  for (int c = 0; c < 256; c++)
+  {
+    ac->root[c] = 0;
+  }
+  for (int k = 0; k < ac->nodes[0].num_children; k++)
+  {
+    ac->root[ac->edge_bytes[1 + k]] = 1 + k;
+  }
+
+  // Every node's parent comes before it, so its fail link, and those
+  // of all shorter suffixes, are known by the time we get to it.
+  ac->nodes[0].fail = 0;
+  ac->nodes[0].out = ac->nodes[0].id >= 0 ? 0 : -1;
+  for (int u = 0; u < num_nodes; u++)
+  {
+    const struct aho_corasick_node *n = &ac->nodes[u];
+    for (int v = n->first_child; v < n->first_child + n->num_children; v++)
+    {
+      struct aho_corasick_node *child = &ac->nodes[v];
+      child->fail = u == 0 ? 0 : ac_step(ac, n->fail, ac->edge_bytes[v]);
+      child->out = child->id >= 0 ? v : ac->nodes[child->fail].out;
+    }
+  }
+}
+
+void aho_corasick_destroy(struct aho_corasick *ac)
+{
+  free(ac->pattern_len);
+  free(ac->next_id);
+  free(ac->nodes);
+  free(ac->edge_bytes);
+}
+
+// The cursor is the state we are in, plus the match we are about to
+// report at 'pos': needle 'id', which ends at node 'out'.
+
+static void ac_set_out(const struct aho_corasick *ac, struct matcher_cursor *c, int out)
+{
+  c->out = out;
+  c->id = out >= 0 ? ac->nodes[out].id : -1;
+}
+
+static void ac_reset(const void *impl, struct matcher_cursor *c, const char *pos)
+{
+  const struct aho_corasick *ac = impl;
+
+  c->pos = pos;
+  c->state = 0;
+  ac_set_out(ac, c, ac->nodes[0].out);
+}
+
+static int ac_next(const void *impl, struct matcher_cursor *c, const char *end, struct match *m)
+{
+  const struct aho_corasick *ac = impl;
+
+  for (;;)
+  {
+    if (c->id >= 0)
+    {
+      m->id = c->id;
+      m->end = c->pos;
+      m->start = c->pos - ac->pattern_len[c->id];
+
+      c->id = ac->next_id[c->id];
+      if (c->id < 0)
+      {
+        ac_set_out(ac, c, c->out == 0 ? -1 : ac->nodes[ac->nodes[c->out].fail].out);
+      }
+      return 1;
+    }
+
+    if (c->pos >= end)
+    {
+      return 0;
+    }
+
+    // Run through the bytes until we reach a node that ends a needle.
+    const char *p = c->pos;
+    int state = c->state;
+    while (p < end)
+    {
+      state = ac_step(ac, state, ac->fold[(unsigned char)*p++]);
+      if (ac->nodes[state].out >= 0)
+      {
+        break;
+      }
+    }
+    c->pos = p;
+    c->state = state;
+
+    if (ac->nodes[state].out < 0)
+    {
+      return 0;
+    }
+    ac_set_out(ac, c, ac->nodes[state].out);
+  }
+}
+
+void aho_corasick_matcher(const struct aho_corasick *ac, struct matcher *m)
+{
+  m->impl = ac;
+  m->num_patterns = ac->num_patterns;
+  m->reset = ac_reset;
+  m->next = ac_next;
+}
@@ -0,0 +1,55 @@
+#ifndef AHO_CORASICK_H
+#define AHO_CORASICK_H
+
+#include <stddef.h>
+
+#include "matcher.h"
+
+// An Aho-Corasick automaton that finds any number of needles in a
+// single pass over the data.  Like a searcher, it is built once and
+// then shared read-only by all threads.
+//
+// Nodes are numbered in breadth-first order, so the shallow part of
+// the trie, where the search spends most of its time, is packed
+// together, and the children of a node have consecutive numbers.  So
+// the edges out of a node are just a short run of 'edge_bytes', which
+// holds the byte on the edge into each node.  The root has a full
+// 256-entry table instead, as almost every byte leaves it.
+
+struct aho_corasick_node
+{
+  int fail;       // Longest proper suffix that is also in the trie.
+  int out;        // Nearest node on the fail chain (or this one) that ends a needle, or -1.
+  int id;         // First needle that ends here, or -1.
+  int first_child;
+  int num_children;
+};
+
+struct aho_corasick
+{
+  int num_patterns;
+  size_t *pattern_len;
+  int *next_id; // The next needle equal to this one, or -1.
+
+  int num_nodes;
+  struct aho_corasick_node *nodes;
+  unsigned char *edge_bytes;
+  int root[256];
+
+  // Applied to every byte before it goes into the automaton; with -i
+  // it folds ASCII letters to lower case.
+  unsigned char fold[256];
+};
+
+// Build the automaton.  The needles are not used after this returns.
+// With 'nocase', ASCII letters match either case.
+void aho_corasick_init(struct aho_corasick *ac, char *const *patterns, int num_patterns,
+                       int nocase);
+
+void aho_corasick_destroy(struct aho_corasick *ac);
+
+// Set up 'm' to report every needle that matches, in the order in
+// which the matches end.
+void aho_corasick_matcher(const struct aho_corasick *ac, struct matcher *m);
+
+#endif
@@ -0,0 +1,234 @@
+#include "batch.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gunzip.h"
+
+void batcher_init(struct batcher *b, struct job_queue *jq, void *arg, int cache_neutral)
+{
+  memset(b, 0, sizeof(*b));
+  b->jq = jq;
+  b->arg = arg;
+  b->cache_neutral = cache_neutral;
+}
+
+void batcher_flush(struct batcher *b)
+{
+  if (b->num_files == 0)
+  {
+    return;
+  }
+
+  size_t header = sizeof(struct batch) + b->num_files * sizeof(struct batch_file);
+  struct batch *batch = malloc(header + b->paths.len);
+  if (batch == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+
+  char *paths = (char *)batch + header;
+  memcpy(paths, b->paths.data, b->paths.len);
+
+  batch->arg = b->arg;
+  batch->num_files = b->num_files;
+  batch->pending = b->num_files;
+
+  for (int i = 0; i < b->num_files; i++)
+  {
+    struct batch_file *f = &batch->files[i];
+    f->seq = b->seqs[i];
+    f->path = paths + b->path_offsets[i];
+    f->size = b->ids[i].size;
+    f->id = b->ids[i];
+    f->unread = b->unread[i];
+    f->cached = b->cached[i];
+    f->mode = file_cache_mode(f->size, b->cache_neutral);
+    f->batch = batch;
+    f->split = NULL;
+    f->part = 0;
+    f->start = 0;
+    f->end = f->size;
+    f->data = NULL;
+    prefetch_hint_init(&f->hint, f->path, 0, f->size);
+    if (f->unread)
+    {
+      // Nothing to prefetch for a file that is not read.
+      f->hint.state = PREFETCH_TAKEN;
+    }
+  }
+
+  job_queue_push(b->jq, batch);
+  b->num_batches++;
+
+  b->num_files = 0;
+  b->bytes = 0;
+  b->paths.len = 0;
+}
+
+// A batch of its own for part 'part' of 'split'.  The caller fills in
+// the size, how to read it and what to prefetch, and pushes it.
+static struct batch_file *part_batch(struct batcher *b, const char *path,
+                                     struct split_file *split, int part)
+{
+  size_t path_len = strlen(path) + 1;
+  size_t header = sizeof(struct batch) + sizeof(struct batch_file);
+  struct batch *batch = malloc(header + path_len);
+  if (batch == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+
+  batch->arg = b->arg;
+  batch->num_files = 1;
+  batch->pending = 1;
+
+  struct batch_file *f = &batch->files[0];
+  f->path = memcpy((char *)batch + header, path, path_len);
+  f->batch = batch;
+  f->seq = b->next_seq;
+  f->unread = 0;
+  f->cached = -1;
+  f->split = split;
+  f->part = part;
+  f->data = NULL;
+  return f;
+}
+
+// Push one batch for every part of a file.
+static void batcher_split(struct batcher *b, const char *path, const struct file_id *id)
+{
+  off_t size = id->size;
+  int num_parts = (size + b->split_size - 1) / b->split_size;
+  struct split_file *split = split_file_new(num_parts);
+
+  for (int i = 0; i < num_parts; i++)
+  {
+    struct batch_file *f = part_batch(b, path, split, i);
+    f->size = size;
+    f->id = *id;
+    f->mode = file_cache_mode(size, b->cache_neutral);
+    f->start = i * b->split_size;
+    f->end = i == num_parts - 1 ? size : f->start + b->split_size;
+    prefetch_hint_init(&f->hint, f->path, f->start, f->end - f->start);
+
+    job_queue_push(b->jq, f->batch);
+    b->num_batches++;
+  }
+  b->next_seq++;
+}
+
+void batcher_add_data(struct batcher *b, const char *path, struct split_file *split, int part,
+                      char *data, size_t len)
+{
+  batcher_flush(b);
+
+  struct batch_file *f = part_batch(b, path, split, part);
+  f->size = len;
+  memset(&f->id, 0, sizeof(f->id));
+  f->mode = FILE_CACHED;
+  f->start = 0;
+  f->end = len;
+  f->data = data;
+  // There is nothing to prefetch.
+  prefetch_hint_init(&f->hint, f->path, 0, 0);
+  f->hint.state = PREFETCH_TAKEN;
+
+  job_queue_push(b->jq, f->batch);
+  b->num_batches++;
+  if (part == split->num_parts - 1)
+  {
+    b->next_seq++;
+  }
+}
+
+// A gzip file can only be inflated from the start, so it is never
+// split.  Looking costs a read, but only for files large enough to
+// split, which we are about to read all of anyway.
+static int is_gzip(const char *path)
+{
+  char magic[2];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  int gzip = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+             gunzip_magic(magic, sizeof(magic));
+  close(fd);
+  return gzip;
+}
+
+static void batcher_append(struct batcher *b, const char *path, const struct file_id *id,
+                           int unread, long cached)
+{
+  off_t size = id->size;
+  if (b->split_size > 0 && size >= 2 * b->split_size && !is_gzip(path))
+  {
+    batcher_flush(b);
+    batcher_split(b, path, id);
+    return;
+  }
+
+  // Large files go alone, but keep the order in which we saw them.
+  if (size >= BATCH_LARGE_FILE || b->bytes + size > BATCH_MAX_BYTES)
+  {
+    batcher_flush(b);
+  }
+
+  // Numbered now, since batcher_skip() may hand out the next numbers
+  // before this batch is pushed.
+  b->seqs[b->num_files] = b->next_seq;
+  b->ids[b->num_files] = *id;
+  b->unread[b->num_files] = unread;
+  b->cached[b->num_files] = cached;
+  b->path_offsets[b->num_files] = b->paths.len;
+  io_buffer_append(&b->paths, path, strlen(path) + 1);
+  b->num_files++;
+  b->next_seq++;
+  b->bytes += size;
+
+  if (size >= BATCH_LARGE_FILE || b->num_files == BATCH_MAX_FILES)
+  {
+    batcher_flush(b);
+  }
+}
+
+void batcher_add(struct batcher *b, const char *path, const struct stat *st)
+{
+  struct file_id id;
+  file_id_stat(&id, st);
+  batcher_append(b, path, &id, 0, -1);
+}
+
+void batcher_add_unread(struct batcher *b, const char *path, long cached)
+{
+  // Nothing is read, so it is as good as empty.
+  struct file_id id = {0, 0, 0, 0};
+  batcher_append(b, path, &id, 1, cached);
+}
+
+long batcher_skip(struct batcher *b)
+{
+  return b->next_seq++;
+}
+
+void batcher_destroy(struct batcher *b)
+{
+  batcher_flush(b);
+  io_buffer_free(&b->paths);
+}
+
+struct prefetch_hint *batch_hint(void *job, int i)
+{
+  struct batch *batch = job;
+  return i < batch->num_files ? &batch->files[i].hint : NULL;
+}
+
+int batch_file_done(struct batch_file *f)
+{
+  return --f->batch->pending == 0;
+}
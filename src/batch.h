@@ -0,0 +1,118 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+#include "job_queue.h"
+#include "prefetch.h"
+#include "split.h"
+
+// Files are handed to the workers in batches, so that a tree of many
+// small files does not cost a queue operation and two allocations per
+// file.  Consecutive small files are collected into one batch until it
+// holds BATCH_MAX_FILES files or BATCH_MAX_BYTES bytes of data.  A file
+// of BATCH_LARGE_FILE bytes or more always gets a batch of its own.
+//
+// If the batcher has a 'split_size', files of at least twice that are
+// split into parts of 'split_size' bytes (see split.h), each of which
+// gets a batch of its own.  All the parts have the file's number.
+// Gzip files are not split, since they can only be read from the start.
+//
+// The parts of a stream are read by the producer, and handed over in
+// memory, each in a batch of its own too.
+#define BATCH_MAX_FILES 64
+#define BATCH_MAX_BYTES (1024 * 1024)
+#define BATCH_LARGE_FILE (256 * 1024)
+
+struct batch;
+
+struct batch_file
+{
+  struct prefetch_hint hint;
+  const char *path;
+  off_t size;
+  struct file_id id; // As it was when the file was found.
+  int mode; // How to read it, see file_cache_mode().
+  struct batch *batch;
+  long seq;   // Numbered from 0 in the order the files were added.
+
+  // A file can be answered without being read: from entry 'cached' of
+  // a result cache if that is not -1, and otherwise as not matching.
+  int unread;
+  long cached;
+
+  // For a part of a split file, the file and the part, and its byte
+  // range.  Otherwise 'split' is NULL, and the range is the whole file.
+  struct split_file *split;
+  int part;
+  off_t start;
+  off_t end;
+
+  // For a part of a stream, its 'size' bytes, which are not read from
+  // 'path'.  Free them with free() once done.  Otherwise NULL.
+  char *data;
+};
+
+// A single job on the queue.  The batch, its files and their paths all
+// live in one allocation, which is released with free().
+struct batch
+{
+  void *arg; // Whatever the producer wants to pass along.
+  int num_files;
+  int pending; // Files not finished yet.
+  struct batch_file files[];
+};
+
+// Collects files on the producer side.
+struct batcher
+{
+  struct job_queue *jq;
+  void *arg;
+  int cache_neutral;
+  off_t split_size; // 0 to never split files.  Set it after batcher_init().
+  long next_seq;    // The number the next file added will get.
+  long num_batches; // Pushed onto the queue so far.
+
+  int num_files;
+  off_t bytes;
+  long seqs[BATCH_MAX_FILES];
+  struct file_id ids[BATCH_MAX_FILES];
+  char unread[BATCH_MAX_FILES];
+  long cached[BATCH_MAX_FILES];
+  size_t path_offsets[BATCH_MAX_FILES];
+  struct io_buffer paths;
+};
+
+void batcher_init(struct batcher *b, struct job_queue *jq, void *arg, int cache_neutral);
+
+// Add a file, pushing batches onto the queue as they fill up.
+void batcher_add(struct batcher *b, const char *path, const struct stat *st);
+
+// Add a file that is answered without being read, from entry 'cached'
+// of a result cache, or with -1, as one that is known not to match.
+void batcher_add_unread(struct batcher *b, const char *path, long cached);
+
+// Push part 'part' of the stream 'split', whose 'len' bytes at 'data'
+// the batch takes over.  The last part also ends the stream's number.
+void batcher_add_data(struct batcher *b, const char *path, struct split_file *split, int part,
+                      char *data, size_t len);
+
+// Give the next number to a file that is dealt with some other way.
+long batcher_skip(struct batcher *b);
+
+// Push whatever has been collected so far.
+void batcher_flush(struct batcher *b);
+
+// Flush and release the batcher's own memory.
+void batcher_destroy(struct batcher *b);
+
+// For prefetch_init(): the i'th file of a batch.
+struct prefetch_hint *batch_hint(void *job, int i);
+
+// Mark a file as finished.  Returns non-zero if it was the last one,
+// in which case the caller should free() the batch.
+int batch_file_done(struct batch_file *f);
+
+#endif
@@ -0,0 +1,365 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as asprintf()) on GNU/Linux
+// systems.
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a.
+static uint64_t hash_query(const char *query, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+  {
+    h = (h ^ (unsigned char)query[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static int compare_ids(const struct file_id *a, const struct file_id *b)
+{
+  const uint64_t x[4] = {a->dev, a->ino, a->size, a->mtime_ns};
+  const uint64_t y[4] = {b->dev, b->ino, b->size, b->mtime_ns};
+  for (int i = 0; i < 4; i++)
+  {
+    if (x[i] != y[i])
+    {
+      return x[i] < y[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  return compare_ids(&((const struct cache_entry *)a)->id, &((const struct cache_entry *)b)->id);
+}
+
+// Map this search's file, if there is a valid one.
+static void cache_load(struct cache *c)
+{
+  int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return;
+  }
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct cache_header))
+  {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return;
+  }
+
+  const struct cache_header *h = map;
+  size_t size = st.st_size;
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 || h->query_len != c->query_len ||
+      sizeof(*h) + h->query_len > size ||
+      memcmp((const char *)map + sizeof(*h), c->query, c->query_len) != 0 ||
+      h->entries + (uint64_t)h->num_entries * sizeof(struct cache_entry) > h->data ||
+      h->data > size)
+  {
+    munmap(map, size);
+    return;
+  }
+
+  c->map = map;
+  c->map_size = size;
+  c->entries = (const struct cache_entry *)((const char *)map + h->entries);
+  c->num_entries = h->num_entries;
+  c->data = (const char *)map + h->data;
+  for (uint32_t i = 0; i < c->num_entries; i++)
+  {
+    if (c->entries[i].data + c->entries[i].len > size - h->data)
+    {
+      // Not one of ours after all.
+      c->num_entries = 0;
+      break;
+    }
+  }
+}
+
+void cache_open(struct cache *c, const char *dir, const char *query, size_t query_len)
+{
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->lock, NULL);
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+  {
+    err(1, "failed to create %s", dir);
+  }
+  if ((c->dir = strdup(dir)) == NULL || (c->query = malloc(query_len + 1)) == NULL ||
+      asprintf(&c->path, "%s/%016llx", dir,
+               (unsigned long long)hash_query(query, query_len)) < 0)
+  {
+    err(1, "malloc() failed");
+  }
+  memcpy(c->query, query, query_len);
+  c->query_len = query_len;
+
+  cache_load(c);
+}
+
+long cache_find(struct cache *c, const struct file_id *id)
+{
+  size_t lo = 0;
+  size_t hi = c->num_entries;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = compare_ids(&c->entries[mid].id, id);
+    if (cmp == 0)
+    {
+      return mid;
+    }
+    if (cmp < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+void cache_add(struct cache *c, const struct file_id *id, int count, int binary,
+               const char *data, size_t len)
+{
+  pthread_mutex_lock(&c->lock);
+  struct cache_entry e = {*id, count, binary, c->new_data.len, len};
+  io_buffer_append(&c->new_entries, (const char *)&e, sizeof(e));
+  io_buffer_append(&c->new_data, data, len);
+  pthread_mutex_unlock(&c->lock);
+}
+
+struct cache_file
+{
+  char *name;
+  off_t size;
+  struct timespec mtime;
+};
+
+static int compare_age(const void *a, const void *b)
+{
+  const struct timespec *x = &((const struct cache_file *)a)->mtime;
+  const struct timespec *y = &((const struct cache_file *)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+  {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Remove the searches used longest ago, until the rest fit in 'limit'.
+static void cache_evict(const char *dir, off_t limit)
+{
+  DIR *d = opendir(dir);
+  if (d == NULL)
+  {
+    warn("failed to open %s", dir);
+    return;
+  }
+
+  struct cache_file *files = NULL;
+  size_t num_files = 0;
+  size_t cap = 0;
+  off_t total = 0;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL)
+  {
+    // Only our own files: 16 hex digits.
+    if (strlen(de->d_name) != 16 || strspn(de->d_name, "0123456789abcdef") != 16)
+    {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+    {
+      continue;
+    }
+
+    if (num_files == cap)
+    {
+      cap = cap == 0 ? 64 : cap * 2;
+      if ((files = realloc(files, cap * sizeof(*files))) == NULL)
+      {
+        err(1, "realloc() failed");
+      }
+    }
+    if ((files[num_files].name = strdup(de->d_name)) == NULL)
+    {
+      err(1, "strdup() failed");
+    }
+    files[num_files].size = st.st_size;
+    files[num_files].mtime = st.st_mtim;
+    num_files++;
+    total += st.st_size;
+  }
+
+  qsort(files, num_files, sizeof(*files), compare_age);
+  for (size_t i = 0; i < num_files; i++)
+  {
+    if (total > limit && unlinkat(dirfd(d), files[i].name, 0) == 0)
+    {
+      total -= files[i].size;
+    }
+    free(files[i].name);
+  }
+  free(files);
+  closedir(d);
+}
+
+static void write_all(FILE *f, const char *path, const void *data, size_t len)
+{
+  if (len > 0 && fwrite(data, len, 1, f) != 1)
+  {
+    err(1, "failed to write %s", path);
+  }
+}
+
+// An entry on its way into the new file, with where its matches are.
+struct merge_entry
+{
+  struct cache_entry e;
+  const char *data;
+  int old;
+};
+
+// By file, with this run's entries first.
+static int compare_merge(const void *a, const void *b)
+{
+  const struct merge_entry *x = a;
+  const struct merge_entry *y = b;
+  if (x->e.id.dev != y->e.id.dev)
+  {
+    return x->e.id.dev < y->e.id.dev ? -1 : 1;
+  }
+  if (x->e.id.ino != y->e.id.ino)
+  {
+    return x->e.id.ino < y->e.id.ino ? -1 : 1;
+  }
+  if (x->old != y->old)
+  {
+    return x->old - y->old;
+  }
+  return compare_ids(&x->e.id, &y->e.id);
+}
+
+void cache_close(struct cache *c, off_t limit)
+{
+  // The entries we had, and the new ones.  A run need not go through
+  // every file, so the old entries are all kept, except where this run
+  // has found a file to have changed.
+  size_t new_entries = c->new_entries.len / sizeof(struct cache_entry);
+  size_t num = c->num_entries + new_entries;
+  struct merge_entry *merge = malloc((num + 1) * sizeof(*merge));
+  if (merge == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  for (size_t i = 0; i < new_entries; i++)
+  {
+    memcpy(&merge[i].e, c->new_entries.data + i * sizeof(struct cache_entry),
+           sizeof(struct cache_entry));
+    merge[i].data = c->new_data.data + merge[i].e.data;
+    merge[i].old = 0;
+  }
+  for (uint32_t i = 0; i < c->num_entries; i++)
+  {
+    merge[new_entries + i].e = c->entries[i];
+    merge[new_entries + i].data = c->data + c->entries[i].data;
+    merge[new_entries + i].old = 1;
+  }
+
+  // One entry per file, the newest.  That also takes care of a file
+  // found under two names, and so searched twice.
+  qsort(merge, num, sizeof(*merge), compare_merge);
+  struct io_buffer entries = {NULL, 0, 0};
+  struct io_buffer data = {NULL, 0, 0};
+  size_t kept = 0;
+  for (size_t i = 0; i < num; i++)
+  {
+    if (i > 0 && merge[i].e.id.dev == merge[i - 1].e.id.dev &&
+        merge[i].e.id.ino == merge[i - 1].e.id.ino)
+    {
+      continue;
+    }
+    struct cache_entry e = merge[i].e;
+    e.data = data.len;
+    io_buffer_append(&entries, (const char *)&e, sizeof(e));
+    io_buffer_append(&data, merge[i].data, e.len);
+    kept++;
+  }
+  free(merge);
+
+  // Looked up by identity.
+  struct cache_entry *sorted = (struct cache_entry *)entries.data;
+  qsort(sorted, kept, sizeof(*sorted), compare_entries);
+
+  struct cache_header h;
+  memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+  h.num_entries = kept;
+  h.query_len = c->query_len;
+  h.entries = (sizeof(h) + c->query_len + 7) & ~(uint64_t)7;
+  h.data = h.entries + kept * sizeof(struct cache_entry);
+  static const char padding[8];
+
+  // Write it next to the old one, and only then replace that.
+  char *tmp;
+  if (asprintf(&tmp, "%s.tmp.%d", c->path, (int)getpid()) < 0)
+  {
+    err(1, "asprintf() failed");
+  }
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+  {
+    err(1, "failed to open %s", tmp);
+  }
+  write_all(f, tmp, &h, sizeof(h));
+  write_all(f, tmp, c->query, c->query_len);
+  write_all(f, tmp, padding, h.entries - sizeof(h) - c->query_len);
+  write_all(f, tmp, sorted, kept * sizeof(struct cache_entry));
+  write_all(f, tmp, data.data, data.len);
+  if (fclose(f) != 0)
+  {
+    err(1, "failed to write %s", tmp);
+  }
+  if (rename(tmp, c->path) != 0)
+  {
+    err(1, "failed to rename %s to %s", tmp, c->path);
+  }
+  free(tmp);
+
+  cache_evict(c->dir, limit);
+
+  io_buffer_free(&entries);
+  io_buffer_free(&data);
+  io_buffer_free(&c->new_entries);
+  io_buffer_free(&c->new_data);
+  if (c->map != NULL)
+  {
+    munmap(c->map, c->map_size);
+  }
+  free(c->query);
+  free(c->path);
+  free(c->dir);
+  pthread_mutex_destroy(&c->lock);
+}
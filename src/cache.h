@@ -0,0 +1,97 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+// A cache of what a search found in each file, so that the files that
+// have not changed since the same search last ran are answered without
+// being opened.
+//
+// The cache is a directory with a file per search, named after a hash
+// of whatever decides what the search finds in a file: the patterns and
+// the options.  The search itself is written into the file as well, to
+// catch the odd hash collision.  For each file searched, it has an entry
+// keyed by the file's identity (see struct file_id), with the number of
+// matching lines, whether the file is binary, and the matches, in
+// whatever form the caller gives them.
+//
+// Each run rewrites its search's file, with a fresh entry for every
+// file it went through, in place of any older entry for that file, and
+// the other entries as they were.  It writes a new file and renames it
+// over the old one, so a run that is cut short leaves the old one be.
+// The file's modification time tells when the search was last used.
+// Then, if the directory holds more than its size limit, the files of
+// the searches used longest ago are removed until it does not.
+
+#define CACHE_MAGIC "FGCACHE1"
+
+struct cache_header
+{
+  char magic[8];
+  uint32_t num_entries;
+  uint32_t query_len; // The search follows the header.
+  uint64_t entries;   // Offset of struct cache_entry[num_entries].
+  uint64_t data;      // Offset of the matches.
+};
+
+struct cache_entry
+{
+  struct file_id id;
+  uint32_t count;
+  uint32_t binary;
+  uint64_t data; // Offset from the start of the matches.
+  uint64_t len;
+};
+
+struct cache
+{
+  char *dir;
+  char *path; // This search's file.
+  char *query;
+  size_t query_len;
+
+  // The entries there were when we started, sorted by identity.
+  void *map;
+  size_t map_size;
+  const struct cache_entry *entries;
+  uint32_t num_entries;
+  const char *data;
+
+  // What the search found in the other files.
+  pthread_mutex_t lock;
+  struct io_buffer new_entries;
+  struct io_buffer new_data;
+};
+
+// Open the cache in 'dir', which is created if need be, for the search
+// described by the 'query_len' bytes at 'query'.
+void cache_open(struct cache *c, const char *dir, const char *query, size_t query_len);
+
+// Look up a file as it is now.  Returns its entry, or -1 if there is
+// none.
+long cache_find(struct cache *c, const struct file_id *id);
+
+static inline const struct cache_entry *cache_entry(const struct cache *c, long e)
+{
+  return &c->entries[e];
+}
+
+static inline const char *cache_data(const struct cache *c, long e)
+{
+  return c->data + c->entries[e].data;
+}
+
+// Record what the search found in a file.  Any thread may do this.
+void cache_add(struct cache *c, const struct file_id *id, int count, int binary,
+               const char *data, size_t len);
+
+// Write this search's entries, and keep the directory within 'limit'
+// bytes.
+void cache_close(struct cache *c, off_t limit);
+
+#endif
@@ -3,10 +3,14 @@
 #define _DEFAULT_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <fts.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,117 +21,1807 @@
 
 #include <pthread.h>
 
+#include "aho_corasick.h"
+#include "batch.h"
+#include "cache.h"
+#include "file_io.h"
+#include "find.h"
+#include "gunzip.h"
+#include "holdback.h"
 #include "job_queue.h"
+#include "manifest.h"
+#include "prefetch.h"
+#include "regex.h"
+#include "reorder.h"
+#include "search.h"
+#include "serve.h"
+#include "split.h"
+#include "trigram.h"
+#include "uring.h"
+#include "writer.h"
 
-struct package
+// How many files each worker keeps in flight with io_uring, and the
+// size of the block read from a file at a time.
+#define URING_DEPTH 8
+#define READ_BLOCK_SIZE (128 * 1024)
+
+// By default, keep the next few queued files warming up, but never more
+// than this many megabytes of them.
+#define PREFETCH_DISTANCE 8
+#define PREFETCH_BUDGET_MB 64
+
+// Files of twice this size or more are split into parts that are
+// searched in parallel.
+#define SPLIT_SIZE_KB (16 * 1024)
+
+// A file's output is written out once the file is done, or as soon as
+// this much of it has piled up, after which the file's output is no
+// longer written in one piece; see write_stdout() for how it is still
+// kept together.
+#define OUTPUT_FLUSH_SIZE (1024 * 1024)
+
+// Standard input is searched in parts of about this size, or
+// --split-size if that is smaller, at most STDIN_WINDOW of them at a
+// time.
+#define STDIN_BLOCK_SIZE (1024 * 1024)
+#define STDIN_WINDOW 64
+#define STDIN_PATH "(standard input)"
+
+// With --sort=traversal, how many files past the oldest unfinished one
+// we hand out before waiting for it.
+#define REORDER_WINDOW 1024
+
+// With a writer thread, how many megabytes of output may wait for it
+// before the workers have to.
+#define WRITER_LIMIT_MB 64
+
+// The default size limit of a result cache directory.
+#define CACHE_SIZE_MB 256
+
+int use_uring = 1;
+int cache_neutral = 0;
+struct prefetch prefetch;
+
+// What to print.
+enum output
+{
+  OUTPUT_LINES,
+  OUTPUT_COUNT,               // -c
+  OUTPUT_FILES_WITH_MATCHES,  // -l
+  OUTPUT_FILES_WITHOUT_MATCH, // -L
+  OUTPUT_QUIET,               // -q
+};
+
+int output = OUTPUT_LINES;
+int max_count = 0; // -m, or 0 for no limit.
+int binary_files = SEARCH_BINARY_MATCHES;
+
+// How to match.
+int extended = 0; // -E
+int nocase = 0;   // -i
+
+// Files of twice this size or more are split into parts this big, or
+// with 0, none are.
+off_t split_size;
+
+// Set with -q once anything matches, to stop everything else.  Also
+// set when the output cannot be written, with 'out_error' telling why.
+int quit = 0;
+int out_error = 0;
+
+// Where the output goes: our own stdout, or with --serve, the client's.
+int out_fd = STDOUT_FILENO;
+
+// With --serve, we answer searches until we are killed, and a failed
+// write only ends the search it is for.
+int serving = 0;
+
+// What the workers have finished, for the end of a search to wait on.
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+long batches_done;
+
+// With --index, the files to search, with the trigrams that tell which
+// of them may match.  With --serve and no index, the files found under
+// the paths given.
+struct trigram_index *search_index;
+struct manifest *manifest;
+
+// With --sort=traversal, files are written in the order they were
+// found, exactly as fauxgrep would.
+int sort_output = 0;
+struct reorder reorder;
+
+// Whether output goes through a writer thread, rather than being
+// written by the workers themselves; -1 to decide by what stdout is.
+int use_writer = -1;
+struct writer writer;
+
+// Without --sort, what keeps the output of a file together.
+struct holdback holdback;
+
+// With --index-build, the workers collect the trigrams of every file
+// rather than searching them.
+struct trigram_builder builder;
+
+// With --cache, what the same search found in each file last time.
+const char *cache_dir = NULL;
+long long cache_size_mb = CACHE_SIZE_MB;
+int use_cache = 0;
+struct cache cache;
+
+// With --index-update, the index being updated, and the trigrams of
+// each file in it.
+struct trigram_index *old_index;
+uint32_t *old_trigrams;
+size_t *old_starts;
+
+// Patterns given with -e and -f.  When there are any, every match says
+// which pattern it is for.
+char **patterns;
+int num_patterns;
+int patterns_cap;
+
+// Per-file state.
+struct grep_state
+{
+  struct batch_file *file;
+  struct search search;
+
+  // For a part of a split file, where to start reading, and the
+  // reader that trims the data to the part's lines.
+  off_t offset;
+  struct split_reader split;
+
+  // What a gzip file is inflated through.
+  struct gunzip gz;
+
+  // What we have to say about the file, not written yet.
+  struct io_buffer out;
+
+  // With a result cache, the matches to keep for next time.
+  struct io_buffer found;
+};
+
+// A match in a part of a split file, held back in the part's output.
+// The line follows it.
+struct held_match
+{
+  int lineno; // Counted from the start of the part.
+  int id;
+  size_t len;
+};
+
+// Every worker keeps one state per file it can have in flight, and
+// hands them out to files as they start.  Their line buffers live as
+// long as the thread, so a file only costs an allocation if it has a
+// longer line than any seen before.
+static __thread struct grep_state states[URING_DEPTH];
+static __thread struct grep_state *free_states[URING_DEPTH];
+static __thread int num_free_states;
+
+static void states_init(void)
+{
+  for (int i = 0; i < URING_DEPTH; i++)
+  {
+    search_init(&states[i].search);
+    gunzip_init(&states[i].gz);
+    free_states[i] = &states[i];
+  }
+  num_free_states = URING_DEPTH;
+}
+
+static void states_destroy(void)
+{
+  for (int i = 0; i < URING_DEPTH; i++)
+  {
+    search_destroy(&states[i].search);
+    gunzip_destroy(&states[i].gz);
+    io_buffer_free(&states[i].out);
+    io_buffer_free(&states[i].found);
+  }
+}
+
+// The output could not be written.  A server only gives up on the
+// search; otherwise there is nobody left to tell.
+static void output_failed(int error)
+{
+  if (!serving)
+  {
+    errno = error;
+    err(1, "write() failed");
+  }
+  __atomic_store_n(&out_error, error, __ATOMIC_RELAXED);
+  __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+}
+
+// Output is formatted into a per-file buffer, and written out with a
+// single write() per file, so that the lines of a file stay together
+// and the workers only take a lock once per file, rather than once per
+// line.
+//
+// A file with OUTPUT_FLUSH_SIZE bytes of output or more writes it in
+// several goes, and so does a split file, one part at a time.  Their
+// pieces go through the holdback, which lets the first such file write
+// until it is done and holds back the output of the others meanwhile,
+// so every file's output stays together, however large.  With
+// --sort=traversal, the output goes through the reorder buffer
+// instead, which only ever writes the oldest unfinished file's, to the
+// same effect.
+//
+// With a writer thread, the workers hand it their buffers instead of
+// writing them, and go on with an empty one.
+static void write_stdout(void *arg, const char *data, size_t len)
+{
+  (void)arg;
+  if (use_writer)
+  {
+    writer_write(&writer, data, len);
+  }
+  else
+  {
+    int error = file_write(out_fd, data, len);
+    if (error != 0)
+    {
+      output_failed(error);
+    }
+  }
+}
+
+// A holdback_write_fn.
+static void write_buffer(void *arg, struct io_buffer *b)
+{
+  (void)arg;
+  if (use_writer)
+  {
+    writer_submit(&writer, b);
+    if (__atomic_load_n(&writer.error, __ATOMIC_RELAXED) != 0)
+    {
+      output_failed(writer.error);
+    }
+  }
+  else
+  {
+    int error = file_write(out_fd, b->data, b->len);
+    if (error != 0)
+    {
+      output_failed(error);
+    }
+    b->len = 0;
+  }
+}
+
+// Write out what the file has to say so far; with 'last', that is all
+// of it.
+static void flush_output(struct grep_state *st, int last)
+{
+  struct io_buffer *out = &st->out;
+  if (sort_output)
+  {
+    if (out->len > 0)
+    {
+      reorder_write(&reorder, st->file->seq, out->data, out->len);
+      out->len = 0;
+    }
+  }
+  else
+  {
+    holdback_write(&holdback, st->file->seq, out, last);
+  }
+}
+
+static void append_string(struct io_buffer *out, const char *s)
+{
+  io_buffer_append(out, s, strlen(s));
+}
+
+static void append_int(struct io_buffer *out, int n)
+{
+  char digits[16];
+  int i = sizeof(digits);
+  do
+  {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  io_buffer_append(out, digits + i, sizeof(digits) - i);
+}
+
+// "path:lineno: line", or "path:lineno:id: line" with -e or -f.
+static void append_line(struct grep_state *st, int lineno, int id, const char *line, size_t len)
+{
+  struct io_buffer *out = &st->out;
+  append_string(out, st->file->path);
+  io_buffer_append(out, ":", 1);
+  append_int(out, lineno);
+  if (num_patterns > 0)
+  {
+    io_buffer_append(out, ":", 1);
+    append_int(out, id + 1);
+  }
+  io_buffer_append(out, ": ", 2);
+  io_buffer_append(out, line, len);
+
+  if (out->len >= OUTPUT_FLUSH_SIZE)
+  {
+    flush_output(st, 0);
+  }
+}
+
+static void hold_match(struct io_buffer *out, int lineno, int id, const char *line, size_t len)
+{
+  struct held_match h = {lineno, id, len};
+  io_buffer_append(out, (const char *)&h, sizeof(h));
+  io_buffer_append(out, line, len);
+}
+
+static void print_match(void *arg, int lineno, int id, const char *line, size_t len)
+{
+  struct grep_state *st = arg;
+
+  if (st->file->split != NULL)
+  {
+    hold_match(&split_part(st->file->split, st->file->part)->out, lineno, id, line, len);
+    return;
+  }
+
+  if (use_cache)
+  {
+    hold_match(&st->found, lineno, id, line, len);
+  }
+  append_line(st, lineno, id, line, len);
+}
+
+// Print held matches, 'lines' lines and 'count' matching lines into
+// the file, stopping at -m lines in all.  With 'found', keep them there
+// too, numbered from the start of the file.
+static void print_held(struct grep_state *st, const char *data, size_t len, int lines, int count,
+                       struct io_buffer *found)
+{
+  int last_lineno = 0;
+
+  for (size_t i = 0; i < len;)
+  {
+    struct held_match h;
+    memcpy(&h, data + i, sizeof(h));
+    i += sizeof(h);
+
+    if (h.lineno != last_lineno)
+    {
+      if (max_count > 0 && count >= max_count)
+      {
+        break;
+      }
+      count++;
+      last_lineno = h.lineno;
+    }
+
+    if (found != NULL)
+    {
+      hold_match(found, lines + h.lineno, h.id, data + i, h.len);
+    }
+    append_line(st, lines + h.lineno, h.id, data + i, h.len);
+    i += h.len;
+  }
+}
+
+// A split_emit_fn, with the state of the part that finished as its
+// argument.  Each part stops at -m lines by itself, but it is up to us
+// to stop at -m lines in all.  Nothing is printed from a binary file,
+// which the first part tells.
+static void print_part(void *arg, struct split_file *f, struct split_part *part)
+{
+  struct grep_state *st = arg;
+
+  if (f->binary)
+  {
+    return;
+  }
+
+  print_held(st, part->out.data, part->out.len, f->lines, f->count, use_cache ? &f->out : NULL);
+
+  // The parts must be written in order, so do it while the file is
+  // still locked.
+  flush_output(st, 0);
+}
+
+// Print whatever is printed once per file.
+static void print_file(struct grep_state *st, int count, int binary)
+{
+  const char *path = st->file->path;
+
+  if (binary && binary_files == SEARCH_BINARY_SKIP)
+  {
+    count = 0;
+  }
+
+  if (output == OUTPUT_QUIET)
+  {
+    if (count > 0)
+    {
+      __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+
+  if (output == OUTPUT_LINES)
+  {
+    if (binary && count > 0)
+    {
+      append_string(&st->out, "Binary file ");
+      append_string(&st->out, path);
+      append_string(&st->out, " matches\n");
+    }
+  }
+  else if (output == OUTPUT_COUNT)
+  {
+    append_string(&st->out, path);
+    io_buffer_append(&st->out, ":", 1);
+    append_int(&st->out, max_count > 0 && count > max_count ? max_count : count);
+    io_buffer_append(&st->out, "\n", 1);
+  }
+  else if ((count > 0) == (output == OUTPUT_FILES_WITH_MATCHES))
+  {
+    append_string(&st->out, path);
+    io_buffer_append(&st->out, "\n", 1);
+  }
+}
+
+static int grep_data(void *arg, const char *buf, size_t len);
+
+static struct grep_state *grep_start(struct batch_file *file)
+{
+  struct grep_state *st = free_states[--num_free_states];
+
+  st->file = file;
+  // Whether a file matches at all is settled by its first match.
+  int first_only = output != OUTPUT_LINES && output != OUTPUT_COUNT;
+  st->search.count_only = output != OUTPUT_LINES;
+  st->search.max_count = first_only ? 1 : max_count;
+  // Only the start of a file tells whether it is binary.
+  st->search.binary_files = file->part == 0 ? binary_files : SEARCH_BINARY_TEXT;
+  search_start(&st->search, file->batch->arg, print_match, st);
+  st->found.len = 0;
+  st->offset = 0;
+  if (file->split != NULL && file->data == NULL)
+  {
+    st->offset = split_reader_start(&st->split, file->start, file->end, search_block, &st->search);
+  }
+  // Only a whole file read from the start can be a gzip file.
+  gunzip_start(&st->gz, file->split == NULL && file->data == NULL, grep_data, st);
+
+  return st;
+}
+
+// Search a block of the file's data, uncompressed.
+static int grep_data(void *arg, const char *buf, size_t len)
+{
+  struct grep_state *st = arg;
+  if (__atomic_load_n(&quit, __ATOMIC_RELAXED))
+  {
+    return 1;
+  }
+  return st->file->split != NULL && st->file->data == NULL ? split_block(&st->split, buf, len)
+                                                          : search_block(&st->search, buf, len);
+}
+
+// Called by the reader for each block of a file.
+static int grep_block(void *arg, const char *buf, size_t len)
+{
+  struct grep_state *st = arg;
+  return gunzip_block(&st->gz, buf, len);
+}
+
+static void grep_done(void *arg, int error, int opened)
+{
+  struct grep_state *st = arg;
+  struct batch_file *file = st->file;
+
+  // Like zcat into grep, we still tell what came before the damage.
+  int broken = error == 0 && gunzip_finish(&st->gz) != 0;
+  if (error != 0)
+  {
+    errno = error;
+    if (opened)
+    {
+      warn("%s: read failed", file->path);
+    }
+    else
+    {
+      warn("failed to open %s", file->path);
+    }
+  }
+  else
+  {
+    if (broken)
+    {
+      warnx("%s: invalid compressed data", file->path);
+    }
+    search_finish(&st->search);
+  }
+
+  // Only a file we have read all of is worth keeping in the cache.
+  // Once -q has stopped us, we may not have.  A stream is never the
+  // same twice.
+  int cache_it = use_cache && !file->unread && file->data == NULL && !broken &&
+                 !__atomic_load_n(&quit, __ATOMIC_RELAXED);
+
+  int last = 1;
+  if (file->split != NULL)
+  {
+    struct split_file *split = file->split;
+    struct split_part *part = split_part(split, file->part);
+    part->lines = st->search.lineno - 1;
+    part->count = st->search.count;
+    part->binary = st->search.binary;
+    if (error != 0)
+    {
+      split->failed = 1;
+    }
+
+    // Whoever prints the last part is the last one to use the file.
+    last = split_part_done(split, file->part, print_part, st);
+    if (last)
+    {
+      if (cache_it && !split->failed)
+      {
+        cache_add(&cache, &file->id, split->count, split->binary, split->out.data,
+                  split->out.len);
+      }
+      print_file(st, split->count, split->binary);
+      split_file_free(split);
+    }
+  }
+  else if (error == 0)
+  {
+    if (cache_it)
+    {
+      cache_add(&cache, &file->id, st->search.count, st->search.binary, st->found.data,
+                st->found.len);
+    }
+    print_file(st, st->search.count, st->search.binary);
+  }
+  flush_output(st, last);
+  if (sort_output && last)
+  {
+    reorder_done(&reorder, file->seq);
+  }
+
+  free(file->data);
+  free_states[num_free_states++] = st;
+  prefetch_done(&prefetch, &file->hint);
+  if (batch_file_done(file))
+  {
+    free(file->batch);
+
+    pthread_mutex_lock(&done_lock);
+    batches_done++;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+  }
+}
+
+// Once -q has its answer, the files still in the queue are retired
+// without being read, and so are files that the index or the result
+// cache answers for.  Returns non-zero if the file was.
+static int grep_skip(struct batch_file *file, int fd)
+{
+  int quitting = __atomic_load_n(&quit, __ATOMIC_RELAXED);
+  if (!file->unread && !quitting)
+  {
+    return 0;
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+
+  struct grep_state *st = grep_start(file);
+  if (file->cached >= 0 && !quitting)
+  {
+    // As if we had searched the file and found the same again.
+    const struct cache_entry *e = cache_entry(&cache, file->cached);
+    print_held(st, cache_data(&cache, file->cached), e->len, 0, 0, NULL);
+    st->search.count = e->count;
+    st->search.binary = e->binary;
+  }
+  grep_done(st, 0, 1);
+  return 1;
+}
+
+// A part of a stream is searched where it is.  Returns non-zero if
+// the file was one.
+static int grep_memory(struct batch_file *file)
+{
+  if (file->data == NULL)
+  {
+    return 0;
+  }
+
+  struct grep_state *st = grep_start(file);
+  grep_data(st, file->data, file->size);
+  grep_done(st, 0, 1);
+  return 1;
+}
+
+// Read a whole file with plain read() calls into the worker's buffer.
+static void grep_file(struct batch_file *file, int fd, char *buf)
+{
+  if (grep_skip(file, fd) || grep_memory(file))
+  {
+    return;
+  }
+
+  int mode = file->mode;
+  if (fd < 0)
+  {
+    fd = file_open(file->path, &mode);
+  }
+
+  struct grep_state *st = grep_start(file);
+  int error =
+    fd < 0 ? errno : file_read(fd, buf, READ_BLOCK_SIZE, st->offset, mode, grep_block, st);
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  grep_done(st, error, fd >= 0);
+}
+
+// Keep several files in flight at once.  We only block on the queue
+// when there is nothing else to wait for.
+static void uring_worker(struct job_queue *jq, struct uring_reader *reader)
+{
+  int queue_done = 0;
+
+  // The batch we are feeding into the reader.  It is freed behind our
+  // back once its last file is done, so remember its size separately.
+  struct batch *job = NULL;
+  int next = 0;
+  int num_files = 0;
+
+  while (!queue_done || !uring_reader_empty(reader))
+  {
+    while (!uring_reader_full(reader))
+    {
+      if (next == num_files)
+      {
+        if (queue_done)
+        {
+          break;
+        }
+
+        int ret = uring_reader_empty(reader) ? job_queue_pop(jq, (void **)&job)
+                                             : job_queue_trypop(jq, (void **)&job);
+        if (ret != 0)
+        {
+          queue_done = ret < 0;
+          break;
+        }
+        next = 0;
+        num_files = job->num_files;
+        prefetch_ahead(&prefetch, jq);
+      }
+
+      struct batch_file *file = &job->files[next++];
+      int fd = prefetch_take(&prefetch, &file->hint);
+      if (!grep_skip(file, fd) && !grep_memory(file))
+      {
+        struct grep_state *st = grep_start(file);
+        uring_reader_add(reader, file->path, fd, st->offset, file->mode, st);
+      }
+    }
+
+    if (!uring_reader_empty(reader) && uring_reader_run(reader) != 0)
+    {
+      err(1, "io_uring_enter() failed");
+    }
+  }
+}
+
+static int index_block(void *arg, const char *buf, size_t len)
+{
+  trigram_set_add(arg, buf, len);
+  return 0;
+}
+
+// The worker for --index-build.  Reads each file and hands its
+// trigrams to the builder.
+void *index_worker(void *arg)
+{
+  struct job_queue *jq = arg;
+
+  struct trigram_set set;
+  trigram_set_init(&set);
+  struct gunzip gz;
+  gunzip_init(&gz);
+  char *buf = io_alloc(READ_BLOCK_SIZE);
+  if (buf == NULL)
+  {
+    err(1, "io_alloc() failed");
+  }
+
+  struct batch *job;
+  while (job_queue_pop(jq, (void **)&job) == 0)
+  {
+    int num_files = job->num_files;
+    for (int i = 0; i < num_files; i++)
+    {
+      struct batch_file *file = &job->files[i];
+      // The file's identity is taken before reading it, so that if it
+      // changes while we do, the index will not take it as up to date.
+      int mode = file->mode;
+      int fd = file_open(file->path, &mode);
+      struct stat st;
+      gunzip_start(&gz, 1, index_block, &set);
+      int error = fd < 0 || fstat(fd, &st) != 0
+                    ? errno
+                    : file_read(fd, buf, READ_BLOCK_SIZE, 0, mode, gunzip_block, &gz);
+
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      if (error != 0)
+      {
+        errno = error;
+        if (fd >= 0)
+        {
+          warn("%s: read failed", file->path);
+        }
+        else
+        {
+          warn("failed to open %s", file->path);
+        }
+        trigram_set_clear(&set);
+      }
+      else
+      {
+        // A search finds what comes before the damage, so the index
+        // has that much too.
+        if (gunzip_finish(&gz) != 0)
+        {
+          warnx("%s: invalid compressed data", file->path);
+        }
+        trigram_builder_add(&builder, file->seq, file->path, &st, &set);
+      }
+
+      if (batch_file_done(file))
+      {
+        free(job);
+      }
+    }
+  }
+
+  free(buf);
+  gunzip_destroy(&gz);
+  trigram_set_destroy(&set);
+  return NULL;
+}
+
+void *worker(void *arg)
+{
+  // job queue is argument
+  struct job_queue *jq = arg;
+
+  states_init();
+
+  struct uring_reader reader;
+  if (use_uring &&
+      uring_reader_init(&reader, URING_DEPTH, READ_BLOCK_SIZE, grep_block, grep_done) == 0)
+  {
+    uring_worker(jq, &reader);
+    uring_reader_destroy(&reader);
+    states_destroy();
+    return NULL;
+  }
+
+  // No io_uring here, so read the files one at a time, into a buffer
+  // that we keep for the lifetime of the thread.
+  char *buf = io_alloc(READ_BLOCK_SIZE);
+  if (buf == NULL)
+  {
+    err(1, "io_alloc() failed");
+  }
+
+  while (1)
+  {
+    struct batch *job;
+    // Take a batch of files from the queue
+    if (job_queue_pop(jq, (void **)&job) == 0)
+    {
+      prefetch_ahead(&prefetch, jq);
+
+      // grep line them.  The last file frees the batch.
+      int num_files = job->num_files;
+      for (int i = 0; i < num_files; i++)
+      {
+        struct batch_file *file = &job->files[i];
+        grep_file(file, prefetch_take(&prefetch, &file->hint), buf);
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  free(buf);
+  states_destroy();
+  return NULL;
+}
+
+// Keep within the reorder window.
+static void make_room(struct batcher *b)
+{
+  if (sort_output && !reorder_fits(&reorder, b->next_seq))
+  {
+    // The file we are waiting for may not have left the batcher.
+    batcher_flush(b);
+    reorder_wait(&reorder, b->next_seq);
+  }
+}
+
+// Hand a file to the workers.  With 'unread', it is known not to
+// match.  What the result cache knows, the workers need not read
+// either.
+static void add_file(struct batcher *b, const char *path, const struct stat *st, int unread)
+{
+  make_room(b);
+  struct file_id id;
+  file_id_stat(&id, st);
+  long cached = use_cache && !unread ? cache_find(&cache, &id) : -1;
+
+  if (unread || cached >= 0)
+  {
+    batcher_add_unread(b, path, cached);
+  }
+  else
+  {
+    batcher_add(b, path, st);
+  }
+}
+
+// A file found while walking the tree.  When updating an index, the
+// files that have not changed keep the trigrams they had, and only the
+// others are read again.
+static void add_found(struct batcher *b, FTSENT *p)
+{
+  if (old_index != NULL)
+  {
+    long id = trigram_index_find(old_index, p->fts_path);
+    struct file_id now;
+    file_id_stat(&now, p->fts_statp);
+    if (id >= 0 && file_id_equal(&old_index->files[id].id, &now))
+    {
+      trigram_builder_add_list(&builder, batcher_skip(b), p->fts_path, p->fts_statp,
+                               old_trigrams + old_starts[id], old_starts[id + 1] - old_starts[id]);
+      return;
+    }
+  }
+
+  add_file(b, p->fts_path, p->fts_statp, 0);
+}
+
+static void add_tree(struct batcher *b, char *const *paths)
+{
+  // FTS_LOGICAL = follow symbolic links
+  // FTS_NOCHDIR = do not change the working directory of the process
+  //
+  // (These are not particularly important distinctions for our simple
+  // uses.)
+  int fts_options = FTS_LOGICAL | FTS_NOCHDIR;
+
+  FTS *ftsp;
+  if ((ftsp = fts_open(paths, fts_options, NULL)) == NULL)
+  {
+    err(1, "fts_open() failed");
+  }
+
+  FTSENT *p;
+  while (!__atomic_load_n(&quit, __ATOMIC_RELAXED) && (p = fts_read(ftsp)) != NULL)
+  {
+    switch (p->fts_info)
+    {
+    case FTS_D:
+      break;
+    case FTS_F:
+      add_found(b, p);
+      break;
+    default:
+      break;
+    }
+  }
+  fts_close(ftsp);
+}
+
+static const char *last_newline(const char *p, size_t len)
+{
+  while (len > 0)
+  {
+    if (p[--len] == '\n')
+    {
+      return p + len;
+    }
+  }
+  return NULL;
+}
+
+// Standard input is read here, and handed out in parts of at least
+// 'block' bytes, cut after a newline, as a split file that goes on for
+// as long as the input does.  A part is only handed out
+// once the next has been read, so we know whether it is the last.
+static void add_stdin(struct batcher *b)
+{
+  make_room(b);
+
+  size_t block = split_size > 0 && split_size < STDIN_BLOCK_SIZE ? split_size : STDIN_BLOCK_SIZE;
+  struct split_file *split = split_stream_new(STDIN_WINDOW);
+  int part = 0;
+  char *pending = NULL;
+  size_t pending_len = 0;
+  struct io_buffer next = {NULL, 0, 0};
+  int eof = 0;
+
+  while (!eof)
+  {
+    io_buffer_reserve(&next, next.len + block);
+    ssize_t n = read(STDIN_FILENO, next.data + next.len, next.cap - next.len);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0)
+    {
+      warn("failed to read %s", STDIN_PATH);
+    }
+    next.len += n > 0 ? n : 0;
+    eof = n <= 0 || __atomic_load_n(&quit, __ATOMIC_RELAXED);
+
+    // A line longer than a block makes a longer part.
+    const char *nl = NULL;
+    if (!eof && (next.len < block || (nl = last_newline(next.data, next.len)) == NULL))
+    {
+      continue;
+    }
+    if (eof && next.len == 0 && pending != NULL)
+    {
+      break;
+    }
+
+    if (pending != NULL)
+    {
+      split_stream_wait(split, part);
+      batcher_add_data(b, STDIN_PATH, split, part++, pending, pending_len);
+    }
+    pending = next.data;
+    pending_len = eof ? next.len : (size_t)(nl + 1 - next.data);
+
+    struct io_buffer rest = {NULL, 0, 0};
+    io_buffer_append(&rest, pending + pending_len, next.len - pending_len);
+    next = rest;
+  }
+  io_buffer_free(&next);
+
+  split_stream_end(split, part + 1);
+  split_stream_wait(split, part);
+  batcher_add_data(b, STDIN_PATH, split, part, pending, pending_len);
+}
+
+// The paths to search, where "-" is standard input.
+static void add_paths(struct batcher *b, char *const *paths)
+{
+  for (; *paths != NULL && !__atomic_load_n(&quit, __ATOMIC_RELAXED); paths++)
+  {
+    if (strcmp(*paths, "-") == 0)
+    {
+      add_stdin(b);
+    }
+    else
+    {
+      char *const root[] = {*paths, NULL};
+      add_tree(b, root);
+    }
+  }
+}
+
+// With --index, only the indexed files that may match are searched, in
+// the order they were indexed, along with any that have changed since.
+// -c and -L still have to report the others, but without reading them.
+static void add_indexed(struct batcher *b, const struct trigram_index *ix, const char *wanted)
+{
+  int report_all = output == OUTPUT_COUNT || output == OUTPUT_FILES_WITHOUT_MATCH;
+
+  for (uint32_t id = 0; id < trigram_index_num_files(ix); id++)
+  {
+    if (__atomic_load_n(&quit, __ATOMIC_RELAXED))
+    {
+      break;
+    }
+
+    const char *path = trigram_index_path(ix, id);
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+      warn("failed to open %s", path);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+      continue;
+    }
+
+    struct file_id now;
+    file_id_stat(&now, &st);
+    int unread = !wanted[id] && file_id_equal(&ix->files[id].id, &now);
+    if (!unread || report_all)
+    {
+      add_file(b, path, &st, unread);
+    }
+  }
+}
+
+// A server searches the files it found under its paths, walking them
+// again only if they have changed.
+static void add_manifest(struct batcher *b, struct manifest *m)
+{
+  manifest_refresh(m);
+
+  for (size_t i = 0; i < manifest_num_files(m); i++)
+  {
+    if (__atomic_load_n(&quit, __ATOMIC_RELAXED))
+    {
+      break;
+    }
+
+    const char *path = manifest_path(m, i);
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+      warn("failed to open %s", path);
+      continue;
+    }
+    if (S_ISREG(st.st_mode))
+    {
+      add_file(b, path, &st, 0);
+    }
+  }
+}
+
+// --index-build: index the files under 'paths' instead of searching.
+// --index-update: the same, but starting from the index that is there,
+// and by default under the paths it was built from.
+static int build_index(const char *index_path, char *const *paths, int num_threads, int update)
+{
+  struct trigram_index ix;
+  char **roots = NULL;
+  if (update)
+  {
+    trigram_index_open(&ix, index_path);
+    roots = trigram_index_roots(&ix);
+    if (*paths == NULL)
+    {
+      paths = roots;
+    }
+
+    old_index = &ix;
+    if ((old_starts = malloc((trigram_index_num_files(&ix) + 1) * sizeof(size_t))) == NULL)
+    {
+      err(1, "malloc() failed");
+    }
+    old_trigrams = trigram_index_by_file(&ix, old_starts);
+  }
+
+  struct job_queue jq;
+  job_queue_init(&jq, 64);
+  trigram_builder_init(&builder);
+
+  pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+  for (int i = 0; i < num_threads; i++)
+  {
+    if (pthread_create(&threads[i], NULL, &index_worker, &jq) != 0)
+    {
+      err(1, "pthread_create() failed");
+    }
+  }
+
+  struct batcher batcher;
+  batcher_init(&batcher, &jq, NULL, cache_neutral);
+  add_tree(&batcher, paths);
+  batcher_destroy(&batcher);
+
+  job_queue_destroy(&jq);
+  for (int i = 0; i < num_threads; i++)
+  {
+    if (pthread_join(threads[i], NULL) != 0)
+    {
+      err(1, "pthread_join() failed");
+    }
+  }
+  free(threads);
+
+  // The new index takes the place of the old one, which stays mapped
+  // until we are done with it.
+  trigram_builder_write(&builder, index_path, paths);
+  trigram_builder_destroy(&builder);
+  if (update)
+  {
+    free(old_trigrams);
+    free(old_starts);
+    free(roots);
+    trigram_index_close(&ix);
+  }
+  return 0;
+}
+
+static void add_pattern(const char *pattern)
 {
-  const char *needle;
-  const char *path;
-};
-pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
+  if (num_patterns == patterns_cap)
+  {
+    patterns_cap = patterns_cap == 0 ? 16 : patterns_cap * 2;
+    if ((patterns = realloc(patterns, patterns_cap * sizeof(char *))) == NULL)
+    {
+      err(1, "realloc() failed");
+    }
+  }
+
+  if ((patterns[num_patterns++] = strdup(pattern)) == NULL)
+  {
+    err(1, "strdup() failed");
+  }
+}
 
-int fauxgrep_file(char const *needle, char const *path)
+// One pattern per line, like grep -f.
+static void read_patterns(const char *path)
 {
   FILE *f = fopen(path, "r");
-
   if (f == NULL)
   {
-    warn("failed to open %s", path);
-    return -1;
+    err(1, "failed to open %s", path);
   }
+
   char *line = NULL;
   size_t linelen = 0;
-  int lineno = 1;
-
-  while (getline(&line, &linelen, f) != -1)
+  ssize_t n;
+  while ((n = getline(&line, &linelen, f)) != -1)
   {
-    if (strstr(line, needle) != NULL)
+    if (n > 0 && line[n - 1] == '\n')
     {
-      pthread_mutex_lock(&stdout_mutex);
-      printf("%s:%d: %s", path, lineno, line);
-      pthread_mutex_unlock(&stdout_mutex);
+      line[n - 1] = '\0';
     }
-
-    lineno++;
+    add_pattern(line);
   }
 
   free(line);
   fclose(f);
+}
+
+static void free_patterns(void)
+{
+  for (int i = 0; i < num_patterns; i++)
+  {
+    free(patterns[i]);
+  }
+  free(patterns);
+  patterns = NULL;
+  num_patterns = patterns_cap = 0;
+}
+
+// The needle, or the patterns of -e and -f, each NUL terminated.
+static void append_patterns(struct io_buffer *out, const char *needle)
+{
+  for (int i = 0; i < (num_patterns == 0 ? 1 : num_patterns); i++)
+  {
+    const char *pattern = num_patterns == 0 ? needle : patterns[i];
+    io_buffer_append(out, pattern, strlen(pattern) + 1);
+  }
+}
+
+// What a search looks for, compiled once and then only read by the
+// workers.  One pattern is best left to the searcher; more go into one
+// automaton, so that we only need a single pass.
+struct query
+{
+  struct searcher searcher;
+  struct aho_corasick ac;
+  struct regex re;
+  struct matcher matcher;
+};
 
+// Returns 0, or -1 if the pattern is not valid.
+static int query_init(struct query *q, const char *needle)
+{
+  if (extended)
+  {
+    if (num_patterns > 1)
+    {
+      errx(1, "-E takes a single pattern");
+    }
+    const char *error;
+    if (regex_init(&q->re, needle, nocase, &error) != 0)
+    {
+      warnx("invalid regular expression '%s': %s", needle, error);
+      return -1;
+    }
+    regex_matcher(&q->re, &q->matcher);
+  }
+  else if (num_patterns <= 1)
+  {
+    searcher_init(&q->searcher, needle, strlen(needle), nocase);
+    searcher_matcher(&q->searcher, &q->matcher);
+  }
+  else
+  {
+    aho_corasick_init(&q->ac, patterns, num_patterns, nocase);
+    aho_corasick_matcher(&q->ac, &q->matcher);
+  }
   return 0;
 }
 
-void *worker(void *arg)
+static void query_destroy(struct query *q)
 {
-  // job queue is argument
-  struct job_queue *jq = arg;
-  while (1)
+  if (extended)
   {
-    struct package *job;
-    // Take a package from the queue
-    if (job_queue_pop(jq, (void **)&job) == 0)
+    regex_destroy(&q->re);
+  }
+  else if (num_patterns > 1)
+  {
+    aho_corasick_destroy(&q->ac);
+  }
+}
+
+// With an index, we only need the files that have every trigram of
+// some string that any match must contain.
+static void query_candidates(const struct query *q, const char *needle, char *wanted)
+{
+  if (extended)
+  {
+    const char *literal = q->re.literal != NULL ? q->re.literal : "";
+    trigram_index_candidates(search_index, literal, strlen(literal), wanted);
+  }
+  else if (num_patterns <= 1)
+  {
+    trigram_index_candidates(search_index, needle, strlen(needle), wanted);
+  }
+  else
+  {
+    for (int i = 0; i < num_patterns; i++)
     {
-      // grep line it
-      fauxgrep_file(job->needle, job->path);
-      free((void*)job->path);
-      free(job);
+      trigram_index_candidates(search_index, patterns[i], strlen(patterns[i]), wanted);
     }
-    else
+  }
+}
+
+// Search the files under 'paths', and standard input for "-", or those
+// of the index or the manifest if there is one, with the workers on
+// 'jq'.  Returns the exit status.
+static int search_files(const char *needle, struct job_queue *jq, char *const *paths)
+{
+  // Only printing the lines themselves would make a mess of binary
+  // files; everything else treats them as text unless told to skip them.
+  if (output != OUTPUT_LINES && binary_files == SEARCH_BINARY_MATCHES)
+  {
+    binary_files = SEARCH_BINARY_TEXT;
+  }
+  quit = 0;
+  out_error = 0;
+  batches_done = 0;
+
+  // A server takes its patterns from anyone, so a bad one only fails
+  // the search.
+  struct query q;
+  if (query_init(&q, needle) != 0)
+  {
+    return 2;
+  }
+
+  char *wanted = NULL;
+  if (search_index != NULL)
+  {
+    if ((wanted = calloc(trigram_index_num_files(search_index) + 1, 1)) == NULL)
     {
-      break;
+      err(1, "calloc() failed");
     }
+    query_candidates(&q, needle, wanted);
   }
 
-  return NULL;
+  // The result cache keeps a file per search, so it needs everything
+  // that decides what a search finds in a file.
+  if (cache_dir != NULL)
+  {
+    struct io_buffer query = {NULL, 0, 0};
+    char options[128];
+    int len = snprintf(options, sizeof(options), "%d %d %d %d %d %d", output, max_count,
+                       binary_files, extended, nocase, num_patterns);
+    io_buffer_append(&query, options, len + 1);
+    append_patterns(&query, needle);
+    cache_open(&cache, cache_dir, query.data, query.len);
+    io_buffer_free(&query);
+    use_cache = 1;
+  }
+
+  // A pipe, socket or terminal may be read slowly, and then we would
+  // rather not have the workers wait for it.  Files and /dev/null
+  // take what they are given.
+  if (use_writer < 0)
+  {
+    struct stat st;
+    use_writer = fstat(out_fd, &st) == 0 &&
+                 (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(out_fd));
+  }
+  if (use_writer)
+  {
+    writer_init(&writer, out_fd, (size_t)WRITER_LIMIT_MB * 1024 * 1024);
+  }
+  if (sort_output)
+  {
+    reorder_init(&reorder, write_stdout, NULL, REORDER_WINDOW);
+  }
+  else
+  {
+    holdback_init(&holdback, write_buffer, NULL);
+  }
+
+  struct batcher batcher;
+  batcher_init(&batcher, jq, &q.matcher, cache_neutral);
+  batcher.split_size = split_size;
+
+  if (search_index != NULL)
+  {
+    add_indexed(&batcher, search_index, wanted);
+  }
+  else if (manifest != NULL)
+  {
+    add_manifest(&batcher, manifest);
+  }
+  else
+  {
+    add_paths(&batcher, paths);
+  }
+  batcher_destroy(&batcher);
+
+  // The workers stay, so wait for them to finish what we gave them.
+  pthread_mutex_lock(&done_lock);
+  while (batches_done < batcher.num_batches)
+  {
+    pthread_cond_wait(&done_cond, &done_lock);
+  }
+  pthread_mutex_unlock(&done_lock);
+
+  if (use_cache)
+  {
+    cache_close(&cache, cache_size_mb * 1024 * 1024);
+    use_cache = 0;
+  }
+  free(wanted);
+  if (sort_output)
+  {
+    reorder_destroy(&reorder);
+  }
+  else
+  {
+    holdback_destroy(&holdback);
+  }
+  if (use_writer)
+  {
+    writer_destroy(&writer);
+    if (writer.error != 0)
+    {
+      output_failed(writer.error);
+    }
+  }
+  query_destroy(&q);
+
+  if (out_error != 0)
+  {
+    return 2;
+  }
+  // Like grep -q, tell whether anything matched.
+  if (output == OUTPUT_QUIET)
+  {
+    return quit ? 0 : 1;
+  }
+  return 0;
 }
 
-int main(int argc, char *const *argv)
+// What a client sends the server: the options that decide what a
+// search finds and how it is printed, followed by the patterns, as
+// append_patterns() puts them.  Everything else is up to the server.
+struct request
 {
-  if (argc < 2)
+  int32_t output;
+  int32_t max_count;
+  int32_t binary_files;
+  int32_t extended;
+  int32_t nocase;
+  int32_t sort_output;
+  int32_t use_writer;
+  int32_t num_patterns;
+  int64_t split_size;
+};
+
+// --client: have the server search, and exit with the status it gives.
+static int run_client(const char *socket_path, const char *needle)
+{
+  struct request r = {output,      max_count,  binary_files, extended, nocase,
+                      sort_output, use_writer, num_patterns, split_size};
+  struct io_buffer msg = {NULL, 0, 0};
+  io_buffer_append(&msg, (const char *)&r, sizeof(r));
+  append_patterns(&msg, needle);
+
+  int sock = serve_connect(socket_path);
+  const int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  serve_send(sock, msg.data, msg.len, fds, 2);
+  io_buffer_free(&msg);
+
+  char status;
+  ssize_t n;
+  while ((n = read(sock, &status, 1)) < 0 && errno == EINTR)
   {
-    err(1, "usage: [-n INT] STRING paths...");
-    exit(1);
   }
+  if (n != 1)
+  {
+    errx(2, "the server on %s went away", socket_path);
+  }
+  close(sock);
+  return status;
+}
+
+// Take the options of a request.  Returns its needle, or NULL if it is
+// not a valid request.
+static const char *take_request(const struct io_buffer *msg)
+{
+  struct request r;
+  if (msg->len < sizeof(r))
+  {
+    return NULL;
+  }
+  memcpy(&r, msg->data, sizeof(r));
+  if (r.output < OUTPUT_LINES || r.output > OUTPUT_QUIET || r.max_count < 0 ||
+      r.binary_files < SEARCH_BINARY_TEXT || r.binary_files > SEARCH_BINARY_MATCHES ||
+      r.use_writer < -1 || r.use_writer > 1 || r.num_patterns < 0 ||
+      (r.extended && r.num_patterns > 1) || r.split_size < 0 || r.split_size % IO_ALIGN != 0)
+  {
+    return NULL;
+  }
+
+  // The patterns, and nothing after them.
+  const char *needle = msg->data + sizeof(r);
+  const char *end = msg->data + msg->len;
+  const char *p = needle;
+  for (int i = 0; i < (r.num_patterns == 0 ? 1 : r.num_patterns); i++)
+  {
+    const char *nul = memchr(p, '\0', end - p);
+    if (nul == NULL)
+    {
+      return NULL;
+    }
+    p = nul + 1;
+  }
+  if (p != end)
+  {
+    return NULL;
+  }
+
+  for (p = needle; p < end && r.num_patterns > 0; p += strlen(p) + 1)
+  {
+    add_pattern(p);
+  }
+  output = r.output;
+  max_count = r.max_count;
+  binary_files = r.binary_files;
+  extended = r.extended != 0;
+  nocase = r.nocase != 0;
+  sort_output = r.sort_output != 0;
+  use_writer = r.use_writer;
+  split_size = r.split_size;
+  return needle;
+}
+
+// --serve: answer the searches of clients on 'socket_path', one at a
+// time, with the workers on 'jq'.  Runs until the server is killed.
+static void serve(const char *socket_path, struct job_queue *jq)
+{
+  // A client that goes away only ends its own search.
+  signal(SIGPIPE, SIG_IGN);
+  serving = 1;
+
+  int listener = serve_listen(socket_path);
+  struct io_buffer msg = {NULL, 0, 0};
+  while (1)
+  {
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+      {
+        err(1, "accept() failed");
+      }
+      continue;
+    }
+
+    int fds[2];
+    if (serve_recv(sock, &msg, fds, 2) != 0)
+    {
+      close(sock);
+      continue;
+    }
+
+    char status = 2;
+    const char *needle = take_request(&msg);
+    if (needle != NULL)
+    {
+      // The client hears about whatever goes wrong with its search.
+      int saved_stderr = dup(STDERR_FILENO);
+      dup2(fds[1], STDERR_FILENO);
+      out_fd = fds[0];
+      status = search_files(needle, jq, NULL);
+      dup2(saved_stderr, STDERR_FILENO);
+      close(saved_stderr);
+      free_patterns();
+    }
+    else
+    {
+      warnx("ignoring an invalid request");
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    // If the client has gone, it does not need to know.
+    send(sock, &status, 1, MSG_NOSIGNAL);
+    close(sock);
+  }
+}
 
+int main(int argc, char *const *argv)
+{
   int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-  char const *needle = argv[1];
-  char *const *paths = &argv[2];
-  if (argc > 3 && strcmp(argv[1], "-n") == 0)
+  int prefetch_distance = PREFETCH_DISTANCE;
+  long long prefetch_budget_mb = PREFETCH_BUDGET_MB;
+  long long split_size_kb = SPLIT_SIZE_KB;
+  const char *index_build = NULL;
+  int index_update = 0;
+  const char *index_path = NULL;
+  const char *serve_path = NULL;
+  const char *client_path = NULL;
+  int pattern_files = 0;
+
+  static const struct option long_options[] = {
+    {"no-uring", no_argument, NULL, 'U'},
+    {"prefetch", required_argument, NULL, 'P'},
+    {"prefetch-budget", required_argument, NULL, 'B'},
+    {"cache-neutral", no_argument, NULL, 'C'},
+    {"split-size", required_argument, NULL, 'S'},
+    {"sort", required_argument, NULL, 'O'},
+    {"writer", required_argument, NULL, 'W'},
+    {"index-build", required_argument, NULL, 'X'},
+    {"index-update", required_argument, NULL, 'Y'},
+    {"index", required_argument, NULL, 'Z'},
+    {"cache", required_argument, NULL, 'K'},
+    {"cache-size", required_argument, NULL, 'M'},
+    {"serve", required_argument, NULL, 'D'},
+    {"client", required_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+n:e:f:EicLlm:qaI", long_options, NULL)) != -1)
   {
-    num_threads = atoi(argv[2]);
+    switch (opt)
+    {
+    case 'n':
+      num_threads = atoi(optarg);
+
+      if (num_threads < 1)
+      {
+        err(1, "invalid thread count: %s", optarg);
+      }
+      break;
+    case 'E':
+      extended = 1;
+      break;
+    case 'i':
+      nocase = 1;
+      break;
+    case 'c':
+      output = OUTPUT_COUNT;
+      break;
+    case 'l':
+      output = OUTPUT_FILES_WITH_MATCHES;
+      break;
+    case 'L':
+      output = OUTPUT_FILES_WITHOUT_MATCH;
+      break;
+    case 'q':
+      output = OUTPUT_QUIET;
+      break;
+    case 'a':
+      binary_files = SEARCH_BINARY_TEXT;
+      break;
+    case 'I':
+      binary_files = SEARCH_BINARY_SKIP;
+      break;
+    case 'm':
+      max_count = atoi(optarg);
+
+      if (max_count < 1)
+      {
+        err(1, "invalid max count: %s", optarg);
+      }
+      break;
+    case 'e':
+      add_pattern(optarg);
+      break;
+    case 'f':
+      read_patterns(optarg);
+      pattern_files = 1;
+      break;
+    case 'U':
+      use_uring = 0;
+      break;
+    case 'P':
+      prefetch_distance = atoi(optarg);
+      break;
+    case 'B':
+      prefetch_budget_mb = atoll(optarg);
+      break;
+    case 'C':
+      cache_neutral = 1;
+      break;
+    case 'S':
+      split_size_kb = atoll(optarg);
+
+      if (split_size_kb < 0)
+      {
+        err(1, "invalid split size: %s", optarg);
+      }
+      break;
+    case 'O':
+      if (strcmp(optarg, "traversal") == 0)
+      {
+        sort_output = 1;
+      }
+      else if (strcmp(optarg, "none") == 0)
+      {
+        sort_output = 0;
+      }
+      else
+      {
+        errx(1, "invalid sort order: %s", optarg);
+      }
+      break;
+    case 'W':
+      if (strcmp(optarg, "yes") == 0)
+      {
+        use_writer = 1;
+      }
+      else if (strcmp(optarg, "no") == 0)
+      {
+        use_writer = 0;
+      }
+      else if (strcmp(optarg, "auto") == 0)
+      {
+        use_writer = -1;
+      }
+      else
+      {
+        errx(1, "invalid writer setting: %s", optarg);
+      }
+      break;
+    case 'X':
+      index_build = optarg;
+      break;
+    case 'Y':
+      index_build = optarg;
+      index_update = 1;
+      break;
+    case 'Z':
+      index_path = optarg;
+      break;
+    case 'K':
+      cache_dir = optarg;
+      break;
+    case 'M':
+      cache_size_mb = atoll(optarg);
+
+      if (cache_size_mb < 0)
+      {
+        err(1, "invalid cache size: %s", optarg);
+      }
+      break;
+    case 'D':
+      serve_path = optarg;
+      break;
+    case 'T':
+      client_path = optarg;
+      break;
+    default:
+      exit(1);
+    }
+  }
 
-    if (num_threads < 1)
+  if (index_build != NULL)
+  {
+    if (optind >= argc && !index_update)
     {
-      err(1, "invalid thread count: %s", argv[2]);
+      errx(1, "usage: [-n INT] [--cache-neutral] --index-build=FILE paths...\n"
+              "       [-n INT] [--cache-neutral] --index-update=FILE [paths...]");
     }
+    return build_index(index_build, &argv[optind], num_threads, index_update);
+  }
+
+  // Parts must start on a block boundary for O_DIRECT.  0 turns
+  // splitting off.
+  split_size = (split_size_kb * 1024 + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+
+  // Empty -f files leave no patterns, and the first path must not be
+  // taken for one.  grep would match nothing; we would rather say so.
+  if (pattern_files && num_patterns == 0)
+  {
+    errx(2, "no patterns to search for: every -f file is empty");
+  }
 
-    needle = argv[3];
-    paths = &argv[4];
+  // A server takes its searches from clients, and only the paths here.
+  const char *needle = NULL;
+  if (serve_path != NULL)
+  {
+    if (index_path == NULL && optind >= argc)
+    {
+      errx(1, "usage: [-n INT] [--no-uring] [--prefetch=FILES] [--prefetch-budget=MB] "
+              "[--cache-neutral] [--cache=DIR] [--cache-size=MB] --serve=SOCKET "
+              "(--index=FILE | paths...)");
+    }
+  }
+  else if (num_patterns == 0 && optind >= argc)
+  {
+    err(1, "usage: [-n INT] [-E] [-i] [-c | -l | -L | -q] [-m NUM] [-a | -I] [-e PATTERN]... "
+           "[-f FILE]... [--no-uring] [--prefetch=FILES] [--prefetch-budget=MB] [--cache-neutral] "
+           "[--split-size=KB] [--sort=traversal|none] [--writer=yes|no|auto] [--index=FILE] "
+           "[--cache=DIR] [--cache-size=MB] [--client=SOCKET] [STRING] [paths...]");
+    exit(1);
   }
   else
   {
-    needle = argv[1];
-    paths = &argv[2];
+    needle = num_patterns == 0 ? argv[optind++] : patterns[0];
+  }
+  char *const *paths = &argv[optind];
+
+  if (client_path != NULL)
+  {
+    if (*paths != NULL)
+    {
+      errx(1, "--client searches the server's files, and takes no paths");
+    }
+    int status = run_client(client_path, needle);
+    free_patterns();
+    return status;
+  }
+
+  struct trigram_index ix;
+  if (index_path != NULL)
+  {
+    if (*paths != NULL)
+    {
+      errx(1, "--index searches the files in the index, and takes no paths");
+    }
+    trigram_index_open(&ix, index_path);
+    search_index = &ix;
+  }
+
+  // Warming up the cache is exactly what cache-neutral mode must not do.
+  if (cache_neutral)
+  {
+    prefetch_distance = 0;
   }
+  prefetch_init(&prefetch, prefetch_distance, prefetch_budget_mb * 1024 * 1024, batch_hint);
 
   struct job_queue jq;
   job_queue_init(&jq, 64);
 
   pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
 
-  // FTS_LOGICAL = follow symbolic links
-  // FTS_NOCHDIR = do not change the working directory of the process
-  //
-  // (These are not particularly important distinctions for our simple
-  // uses.)
-  int fts_options = FTS_LOGICAL | FTS_NOCHDIR;
-
-  FTS *ftsp;
-  if ((ftsp = fts_open(paths, fts_options, NULL)) == NULL)
-  {
-    err(1, "fts_open() failed");
-    return -1;
-  }
   // Initialize threads.
   for (int i = 0; i < num_threads; i++)
   {
@@ -137,25 +1831,24 @@ int main(int argc, char *const *argv)
     }
   }
 
-  FTSENT *p;
-  struct package *pkg;
-  while ((p = fts_read(ftsp)) != NULL)
+  int status = 0;
+  if (serve_path != NULL)
   {
-    switch (p->fts_info)
+    // Found once, and kept up to date.
+    struct manifest m;
+    if (search_index == NULL)
     {
-    case FTS_D:
-      break;
-    case FTS_F:
-      pkg = malloc(sizeof(struct package));
-      pkg->needle = needle;
-      pkg->path = strdup(p->fts_path);
-      job_queue_push(&jq, (void *)pkg);
-      break;
-    default:
-      break;
+      manifest_init(&m, paths);
+      manifest = &m;
     }
+    serve(serve_path, &jq);
+  }
+  else
+  {
+    // Like grep, with no paths we search standard input.
+    static char *const stdin_paths[] = {"-", NULL};
+    status = search_files(needle, &jq, *paths != NULL ? paths : stdin_paths);
   }
-  fts_close(ftsp);
 
   // Destroy the queue.
   job_queue_destroy(&jq);
@@ -167,5 +1860,11 @@ int main(int argc, char *const *argv)
     }
   }
   free(threads);
-  return 0;
+
+  if (index_path != NULL)
+  {
+    trigram_index_close(&ix);
+  }
+  free_patterns();
+  return status;
 }
@@ -17,6 +17,156 @@ for dir in "${ARGS[@]}"; do
         echo "Test failed: line counts differ (orig=$count1, mt=$count2)"
     fi
 
+    # With several patterns, a line is reported once for every pattern in it.
+    count3=$(( $(./fauxgrep hi "$dir" | wc -l) + $(./fauxgrep here "$dir" | wc -l) ))
+    count4=$(./fauxgrep-mt -e hi -e here "$dir" | wc -l)
+
+    if [[ "$count3" -eq "$count4" ]]; then
+        echo "Test passed: same number of pattern matches ($count3)"
+    else
+        echo "Test failed: pattern match counts differ (orig=$count3, mt=$count4)"
+    fi
+
+    # A regular expression that only matches 'hi' finds the same lines.
+    count5=$(./fauxgrep-mt -E '(h)[i]' "$dir" | wc -w)
+
+    if [[ "$count1" -eq "$count5" ]]; then
+        echo "Test passed: same number of regex matching words ($count5)"
+    else
+        echo "Test failed: regex word counts differ (orig=$count1, mt=$count5)"
+    fi
+
+    count6=$(./fauxgrep -i HI "$dir" | wc -w)
+    count7=$(./fauxgrep-mt -i HI "$dir" | wc -w)
+
+    if [[ "$count6" -eq "$count7" ]]; then
+        echo "Test passed: same number of case-insensitive matching words ($count6)"
+    else
+        echo "Test failed: case-insensitive word counts differ (orig=$count6, mt=$count7)"
+    fi
+
+    # -c counts the same lines that would have been printed.
+    count8=$(./fauxgrep hi "$dir" | wc -l)
+    count9=$(./fauxgrep-mt -c hi "$dir" | awk -F: '{ n += $NF } END { print n + 0 }')
+
+    if [[ "$count8" -eq "$count9" ]]; then
+        echo "Test passed: same number of counted lines ($count8)"
+    else
+        echo "Test failed: line counts differ (orig=$count8, mt -c=$count9)"
+    fi
+
+    # -l lists the files that -c counts any lines in.
+    files1=$(./fauxgrep -c hi "$dir" | grep -vc ':0$')
+    files2=$(./fauxgrep-mt -l hi "$dir" | wc -l)
+
+    if [[ "$files1" -eq "$files2" ]]; then
+        echo "Test passed: same number of matching files ($files1)"
+    else
+        echo "Test failed: matching file counts differ (orig=$files1, mt -l=$files2)"
+    fi
+
+    ./fauxgrep-mt -q hi "$dir"
+    status=$?
+    if [[ ( "$files1" -gt 0 && "$status" -eq 0 ) || ( "$files1" -eq 0 && "$status" -eq 1 ) ]]; then
+        echo "Test passed: -q exit status ($status)"
+    else
+        echo "Test failed: -q exit status $status with $files1 matching files"
+    fi
+
+    # -I leaves out the same binary files.
+    files3=$(./fauxgrep -I -l e "$dir" | wc -l)
+    files4=$(./fauxgrep-mt -I -l e "$dir" | wc -l)
+
+    if [[ "$files3" -eq "$files4" ]]; then
+        echo "Test passed: same number of matching text files ($files3)"
+    else
+        echo "Test failed: matching text file counts differ (orig=$files3, mt=$files4)"
+    fi
+
+    # Splitting files into 4 KB parts does not change the output.
+    bytes1=$(./fauxgrep e "$dir" | wc -c)
+    bytes2=$(./fauxgrep-mt --split-size=4 e "$dir" | wc -c)
+
+    if [[ "$bytes1" -eq "$bytes2" ]]; then
+        echo "Test passed: same output size with split files ($bytes1)"
+    else
+        echo "Test failed: output sizes differ (orig=$bytes1, mt split=$bytes2)"
+    fi
+
+    # The lines of a split file stay together.
+    paths=$(./fauxgrep-mt --split-size=4 e "$dir" | cut -d: -f1)
+    runs1=$(echo -n "$paths" | sort -u | wc -l)
+    runs2=$(echo -n "$paths" | uniq | wc -l)
+
+    if [[ "$runs1" -eq "$runs2" ]]; then
+        echo "Test passed: each file's lines together ($runs1)"
+    else
+        echo "Test failed: files' lines broken up (files=$runs1, runs=$runs2)"
+    fi
+
+    # Standard input, cut into 4 KB parts, is searched like a file.
+    file=$(find "$dir" -type f -print -quit)
+    file=${file:-/dev/null}
+    if cmp -s <(./fauxgrep e "$file" | sed "s|^$file:|(standard input):|") \
+              <(./fauxgrep-mt --split-size=4 e < "$file"); then
+        echo "Test passed: same output from standard input"
+    else
+        echo "Test failed: output differs from standard input"
+    fi
+
+    # A gzip file is searched as what it holds.
+    gz=$(mktemp)
+    gzip -c "$file" > "$gz"
+    if cmp -s <(./fauxgrep e "$file" | sed "s|^$file:|$gz:|") <(./fauxgrep-mt e "$gz"); then
+        echo "Test passed: same output from a gzip file"
+    else
+        echo "Test failed: output differs from a gzip file"
+    fi
+    rm -f "$gz"
+
+    # --sort=traversal prints exactly what fauxgrep does, in its order.
+    if cmp -s <(./fauxgrep e "$dir") <(./fauxgrep-mt --sort=traversal --split-size=4 e "$dir"); then
+        echo "Test passed: same output in traversal order"
+    else
+        echo "Test failed: output differs in traversal order"
+    fi
+
+    # Searching through a trigram index finds exactly the same, also
+    # after an update that keeps what it had.
+    index=$(mktemp)
+    ./fauxgrep-mt --index-build="$index" "$dir"
+    ./fauxgrep-mt --index-update="$index"
+    if cmp -s <(./fauxgrep hi "$dir") <(./fauxgrep-mt --sort=traversal --index="$index" hi); then
+        echo "Test passed: same output through the index"
+    else
+        echo "Test failed: output differs through the index"
+    fi
+    rm -f "$index"
+
+    # A second search answered from the result cache finds the same.
+    cache=$(mktemp -d)
+    ./fauxgrep-mt --cache="$cache" hi "$dir" > /dev/null
+    if cmp -s <(./fauxgrep hi "$dir") <(./fauxgrep-mt --sort=traversal --cache="$cache" hi "$dir"); then
+        echo "Test passed: same output from the result cache"
+    else
+        echo "Test failed: output differs from the result cache"
+    fi
+    rm -rf "$cache"
+
+    # A server finds the same as a search of its own.
+    sock=$(mktemp -u)
+    ./fauxgrep-mt --serve="$sock" "$dir" &
+    server=$!
+    while [[ ! -S "$sock" ]]; do sleep 0.1; done
+    if cmp -s <(./fauxgrep hi "$dir") <(./fauxgrep-mt --client="$sock" --sort=traversal hi); then
+        echo "Test passed: same output from the server"
+    else
+        echo "Test failed: output differs from the server"
+    fi
+    kill "$server"
+    wait "$server" 2> /dev/null
+    rm -f "$sock"
+
    # --- Measure average execution times (100 runs) ---
 runs=10
 total1=0
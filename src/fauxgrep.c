@@ -3,6 +3,7 @@
 #define _DEFAULT_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,51 +11,174 @@
 #include <fts.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 // err.h contains various nonstandard BSD extensions, but they are
 // very handy.
 #include <err.h>
 
-int fauxgrep_file(char const *needle, char const *path)
+#include "file_io.h"
+#include "find.h"
+#include "regex.h"
+#include "search.h"
+
+// The size of the block read from a file at a time.
+#define READ_BLOCK_SIZE (128 * 1024)
+
+// Reused for every file.
+char *read_buf;
+struct search search;
+struct searcher searcher;
+struct regex re;
+struct matcher matcher;
+
+// What to print.
+enum output
+{
+  OUTPUT_LINES,
+  OUTPUT_COUNT,               // -c
+  OUTPUT_FILES_WITH_MATCHES,  // -l
+  OUTPUT_FILES_WITHOUT_MATCH, // -L
+  OUTPUT_QUIET,               // -q
+};
+
+int output = OUTPUT_LINES;
+int found; // Has anything matched?
+
+static void print_match(void *arg, int lineno, int id, const char *line, size_t len)
 {
-  FILE *f = fopen(path, "r");
+  (void)id;
+  char const *path = arg;
+  printf("%s:%d: %.*s", path, lineno, (int)len, line);
+}
+
+int fauxgrep_file(char const *path)
+{
+  int mode = FILE_CACHED;
+  int fd = file_open(path, &mode);
 
-  if (f == NULL)
+  if (fd < 0)
   {
     warn("failed to open %s", path);
     return -1;
   }
 
-  char *line = NULL;
-  size_t linelen = 0;
-  int lineno = 1;
+  search_start(&search, &matcher, print_match, (void *)path);
+  int error = file_read(fd, read_buf, READ_BLOCK_SIZE, 0, mode, search_block, &search);
+  if (error != 0)
+  {
+    errno = error;
+    warn("%s: read failed", path);
+  }
+  search_finish(&search);
 
-  while (getline(&line, &linelen, f) != -1)
+  found |= search.count > 0;
+  if (output == OUTPUT_LINES && search.binary && search.count > 0)
+  {
+    printf("Binary file %s matches\n", path);
+  }
+  else if (output == OUTPUT_COUNT)
+  {
+    printf("%s:%d\n", path, search.count);
+  }
+  else if (output == OUTPUT_FILES_WITH_MATCHES || output == OUTPUT_FILES_WITHOUT_MATCH)
   {
-    if (strstr(line, needle) != NULL)
+    if ((search.count > 0) == (output == OUTPUT_FILES_WITH_MATCHES))
     {
-      printf("%s:%d: %s", path, lineno, line);
+      printf("%s\n", path);
     }
-
-    lineno++;
   }
 
-  free(line);
-  fclose(f);
+  close(fd);
 
   return 0;
 }
 
 int main(int argc, char *const *argv)
 {
-  if (argc < 2)
+  int extended = 0;
+  int nocase = 0;
+  int max_count = 0;
+  int binary_files = SEARCH_BINARY_MATCHES;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+EicLlm:qaI")) != -1)
   {
-    err(1, "usage: STRING paths...");
+    switch (opt)
+    {
+    case 'E':
+      extended = 1;
+      break;
+    case 'i':
+      nocase = 1;
+      break;
+    case 'c':
+      output = OUTPUT_COUNT;
+      break;
+    case 'l':
+      output = OUTPUT_FILES_WITH_MATCHES;
+      break;
+    case 'L':
+      output = OUTPUT_FILES_WITHOUT_MATCH;
+      break;
+    case 'q':
+      output = OUTPUT_QUIET;
+      break;
+    case 'a':
+      binary_files = SEARCH_BINARY_TEXT;
+      break;
+    case 'I':
+      binary_files = SEARCH_BINARY_SKIP;
+      break;
+    case 'm':
+      max_count = atoi(optarg);
+
+      if (max_count < 1)
+      {
+        err(1, "invalid max count: %s", optarg);
+      }
+      break;
+    default:
+      exit(1);
+    }
+  }
+
+  if (optind >= argc)
+  {
+    err(1, "usage: [-E] [-i] [-c | -l | -L | -q] [-m NUM] [-a | -I] STRING paths...");
     exit(1);
   }
 
-  char const *needle = argv[1];
-  char *const *paths = &argv[2];
+  char const *needle = argv[optind];
+  char *const *paths = &argv[optind + 1];
+
+  if ((read_buf = io_alloc(READ_BLOCK_SIZE)) == NULL)
+  {
+    err(1, "io_alloc() failed");
+  }
+  search_init(&search);
+  // Whether a file matches at all is settled by its first match.
+  search.count_only = output != OUTPUT_LINES;
+  search.max_count = output == OUTPUT_LINES || output == OUTPUT_COUNT ? max_count : 1;
+  // Only printing the lines themselves would make a mess of binary
+  // files; everything else treats them as text unless told to skip them.
+  search.binary_files =
+    output != OUTPUT_LINES && binary_files == SEARCH_BINARY_MATCHES ? SEARCH_BINARY_TEXT
+                                                                    : binary_files;
+  if (extended)
+  {
+    const char *error;
+    if (regex_init(&re, needle, nocase, &error) != 0)
+    {
+      errx(1, "invalid regular expression '%s': %s", needle, error);
+    }
+    regex_matcher(&re, &matcher);
+  }
+  else
+  {
+    searcher_init(&searcher, needle, strlen(needle), nocase);
+    searcher_matcher(&searcher, &matcher);
+  }
 
   // FTS_LOGICAL = follow symbolic links
   // FTS_NOCHDIR = do not change the working directory of the process
@@ -71,14 +195,14 @@ int main(int argc, char *const *argv)
   }
 
   FTSENT *p;
-  while ((p = fts_read(ftsp)) != NULL)
+  while (!(output == OUTPUT_QUIET && found) && (p = fts_read(ftsp)) != NULL)
   {
     switch (p->fts_info)
     {
     case FTS_D:
       break;
     case FTS_F:
-      fauxgrep_file(needle, p->fts_path);
+      fauxgrep_file(p->fts_path);
       break;
     default:
       break;
@@ -87,5 +211,17 @@ int main(int argc, char *const *argv)
 
   fts_close(ftsp);
 
+  search_destroy(&search);
+  if (extended)
+  {
+    regex_destroy(&re);
+  }
+  free(read_buf);
+
+  // Like grep -q, tell whether anything matched.
+  if (output == OUTPUT_QUIET)
+  {
+    return found ? 0 : 1;
+  }
   return 0;
 }
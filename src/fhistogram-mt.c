@@ -3,6 +3,8 @@
 #define _DEFAULT_SOURCE
 
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,7 +14,21 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "batch.h"
+#include "file_io.h"
 #include "job_queue.h"
+#include "prefetch.h"
+#include "uring.h"
+
+// How many files each worker keeps in flight with io_uring, and the
+// size of the block read from a file at a time.
+#define URING_DEPTH 8
+#define READ_BLOCK_SIZE (128 * 1024)
+
+// By default, keep the next few queued files warming up, but never more
+// than this many megabytes of them.
+#define PREFETCH_DISTANCE 8
+#define PREFETCH_BUDGET_MB 64
 
 pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -23,64 +39,204 @@ pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 #include "histogram.h"
 int global_histogram[8] = {0};
 
-struct package
+int use_uring = 1;
+int cache_neutral = 0;
+struct prefetch prefetch;
+
+// Per-file state.  The file arrives in blocks, so the counts live here.
+struct histogram_state
 {
-  const char *path;
+  struct batch_file *file;
+  int local_histogram[8];
+  int i;
 };
 
+// Every worker keeps one state per file it can have in flight.
+static __thread struct histogram_state states[URING_DEPTH];
+static __thread struct histogram_state *free_states[URING_DEPTH];
+static __thread int num_free_states;
 
-int fhistogram(char const *path)
+static void states_init(void)
 {
-  
-  FILE *f = fopen(path, "r");
-
-  int local_histogram[8] = {0};
-
-  if (f == NULL)
+  for (int i = 0; i < URING_DEPTH; i++)
   {
-    fflush(stdout);
-    warn("failed to open %s", path);
-    return -1;
+    free_states[i] = &states[i];
   }
+  num_free_states = URING_DEPTH;
+}
+
+static struct histogram_state *histogram_start(struct batch_file *file)
+{
+  struct histogram_state *st = free_states[--num_free_states];
 
-  int i = 0;
+  st->file = file;
+  memset(st->local_histogram, 0, sizeof(st->local_histogram));
+  st->i = 0;
 
-  char c;
-  while (fread(&c, sizeof(c), 1, f) == 1)
+  return st;
+}
+
+// Called by the reader for each block of a file.
+static int histogram_block(void *arg, const char *buf, size_t len)
+{
+  struct histogram_state *st = arg;
+
+  for (size_t j = 0; j < len; j++)
   {
-    i++; 
-    update_histogram(local_histogram, c);
-     if ((i % 500000) == 0)
+    st->i++;
+    update_histogram(st->local_histogram, buf[j]);
+    if ((st->i % 500000) == 0)
     {
       pthread_mutex_lock(&stdout_mutex);
-      merge_histogram(local_histogram, global_histogram);
+      merge_histogram(st->local_histogram, global_histogram);
       print_histogram(global_histogram);
       pthread_mutex_unlock(&stdout_mutex);
-    } 
+    }
   }
-  
-  fclose(f);
 
-  pthread_mutex_lock(&stdout_mutex);
-  merge_histogram(local_histogram, global_histogram);
-  print_histogram(global_histogram);
-  pthread_mutex_unlock(&stdout_mutex);
   return 0;
 }
 
+static void histogram_done(void *arg, int error, int opened)
+{
+  struct histogram_state *st = arg;
+  struct batch_file *file = st->file;
+
+  if (error != 0)
+  {
+    fflush(stdout);
+    errno = error;
+    if (opened)
+    {
+      warn("%s: read failed", file->path);
+    }
+    else
+    {
+      warn("failed to open %s", file->path);
+    }
+  }
+
+  // Whatever was read of a file is counted, as the periodic merges in
+  // histogram_block() have counted some of it already.
+  if (error == 0 || opened)
+  {
+    pthread_mutex_lock(&stdout_mutex);
+    merge_histogram(st->local_histogram, global_histogram);
+    print_histogram(global_histogram);
+    pthread_mutex_unlock(&stdout_mutex);
+  }
+
+  free_states[num_free_states++] = st;
+  prefetch_done(&prefetch, &file->hint);
+  if (batch_file_done(file))
+  {
+    free(file->batch);
+  }
+}
+
+// Read a whole file with plain read() calls into the worker's buffer.
+static void histogram_file(struct batch_file *file, int fd, char *buf)
+{
+  int mode = file->mode;
+  if (fd < 0)
+  {
+    fd = file_open(file->path, &mode);
+  }
+
+  struct histogram_state *st = histogram_start(file);
+  int error = fd < 0 ? errno : file_read(fd, buf, READ_BLOCK_SIZE, 0, mode, histogram_block, st);
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  histogram_done(st, error, fd >= 0);
+}
+
+// Keep several files in flight at once.  We only block on the queue
+// when there is nothing else to wait for.
+static void uring_worker(struct job_queue *jq, struct uring_reader *reader)
+{
+  int queue_done = 0;
+
+  // The batch we are feeding into the reader.  It is freed behind our
+  // back once its last file is done, so remember its size separately.
+  struct batch *job = NULL;
+  int next = 0;
+  int num_files = 0;
+
+  while (!queue_done || !uring_reader_empty(reader))
+  {
+    while (!uring_reader_full(reader))
+    {
+      if (next == num_files)
+      {
+        if (queue_done)
+        {
+          break;
+        }
+
+        int ret = uring_reader_empty(reader) ? job_queue_pop(jq, (void **)&job)
+                                             : job_queue_trypop(jq, (void **)&job);
+        if (ret != 0)
+        {
+          queue_done = ret < 0;
+          break;
+        }
+        next = 0;
+        num_files = job->num_files;
+        prefetch_ahead(&prefetch, jq);
+      }
+
+      struct batch_file *file = &job->files[next++];
+      uring_reader_add(reader, file->path, prefetch_take(&prefetch, &file->hint), 0, file->mode,
+                       histogram_start(file));
+    }
+
+    if (!uring_reader_empty(reader) && uring_reader_run(reader) != 0)
+    {
+      err(1, "io_uring_enter() failed");
+    }
+  }
+}
 
 void *worker(void *arg)
 {
   struct job_queue *jq = arg;
 
+  states_init();
+
+  struct uring_reader reader;
+  if (use_uring &&
+      uring_reader_init(&reader, URING_DEPTH, READ_BLOCK_SIZE, histogram_block, histogram_done) == 0)
+  {
+    uring_worker(jq, &reader);
+    uring_reader_destroy(&reader);
+    return NULL;
+  }
+
+  // No io_uring here, so read the files one at a time, into a buffer
+  // that we keep for the lifetime of the thread.
+  char *buf = io_alloc(READ_BLOCK_SIZE);
+  if (buf == NULL)
+  {
+    err(1, "io_alloc() failed");
+  }
+
   while (1)
   {
-    struct package *job;
+    struct batch *job;
     if (job_queue_pop(jq, (void **)&job) == 0)
     {
-      fhistogram(job->path);
-      free((void*)job->path);
-      free(job);
+      prefetch_ahead(&prefetch, jq);
+
+      // The last file frees the batch.
+      int num_files = job->num_files;
+      for (int i = 0; i < num_files; i++)
+      {
+        struct batch_file *file = &job->files[i];
+        histogram_file(file, prefetch_take(&prefetch, &file->hint), buf);
+      }
     }
     else
     {
@@ -91,40 +247,75 @@ void *worker(void *arg)
     }
   }
 
+  free(buf);
   return NULL;
 }
 
 int main(int argc, char *const *argv)
 {
-  if (argc < 2)
-  {
-    err(1, "usage: paths...");
-    exit(1);
-  }
-  char *const *paths = &argv[1];
   int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-
-  if (argc > 3 && strcmp(argv[1], "-n") == 0)
+  int prefetch_distance = PREFETCH_DISTANCE;
+  long long prefetch_budget_mb = PREFETCH_BUDGET_MB;
+
+  static const struct option long_options[] = {
+    {"no-uring", no_argument, NULL, 'U'},
+    {"prefetch", required_argument, NULL, 'P'},
+    {"prefetch-budget", required_argument, NULL, 'B'},
+    {"cache-neutral", no_argument, NULL, 'C'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+n:", long_options, NULL)) != -1)
   {
-    // Since atoi() simply returns zero on syntax errors, we cannot
-    // distinguish between the user entering a zero, or some
-    // non-numeric garbage.  In fact, we cannot even tell whether the
-    // given option is suffixed by garbage, i.e. '123foo' returns
-    // '123'.  A more robust solution would use strtol(), but its
-    // interface is more complicated, so here we are.
-    num_threads = atoi(argv[2]);
-
-    if (num_threads < 1)
+    switch (opt)
     {
-      err(1, "invalid thread count: %s", argv[2]);
+    case 'n':
+      // Since atoi() simply returns zero on syntax errors, we cannot
+      // distinguish between the user entering a zero, or some
+      // non-numeric garbage.  In fact, we cannot even tell whether the
+      // given option is suffixed by garbage, i.e. '123foo' returns
+      // '123'.  A more robust solution would use strtol(), but its
+      // interface is more complicated, so here we are.
+      num_threads = atoi(optarg);
+
+      if (num_threads < 1)
+      {
+        err(1, "invalid thread count: %s", optarg);
+      }
+      break;
+    case 'U':
+      use_uring = 0;
+      break;
+    case 'P':
+      prefetch_distance = atoi(optarg);
+      break;
+    case 'B':
+      prefetch_budget_mb = atoll(optarg);
+      break;
+    case 'C':
+      cache_neutral = 1;
+      break;
+    default:
+      exit(1);
     }
+  }
 
-    paths = &argv[3];
+  if (optind >= argc)
+  {
+    err(1, "usage: [-n INT] [--no-uring] [--prefetch=FILES] [--prefetch-budget=MB] "
+           "[--cache-neutral] paths...");
+    exit(1);
   }
-  else
+
+  char *const *paths = &argv[optind];
+
+  // Warming up the cache is exactly what cache-neutral mode must not do.
+  if (cache_neutral)
   {
-    paths = &argv[1];
+    prefetch_distance = 0;
   }
+  prefetch_init(&prefetch, prefetch_distance, prefetch_budget_mb * 1024 * 1024, batch_hint);
 
   struct job_queue jq;
   job_queue_init(&jq, 64);
@@ -155,6 +346,9 @@ int main(int argc, char *const *argv)
     }
   }
 
+  struct batcher batcher;
+  batcher_init(&batcher, &jq, NULL, cache_neutral);
+
   FTSENT *p;
 
   while ((p = fts_read(ftsp)) != NULL)
@@ -164,18 +358,15 @@ int main(int argc, char *const *argv)
     case FTS_D:
       break;
     case FTS_F:
-    {
-      struct package *pkg = malloc(sizeof(struct package));
-      pkg->path = strdup(p->fts_path);
-      job_queue_push(&jq, (void *)pkg);
+      batcher_add(&batcher, p->fts_path, p->fts_statp);
       break;
-    }
     default:
       break;
     }
   }
 
   fts_close(ftsp);
+  batcher_destroy(&batcher);
 
   job_queue_destroy(&jq);
   for (int i = 0; i < num_threads; i++)
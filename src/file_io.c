@@ -0,0 +1,211 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as O_DIRECT) on GNU/Linux systems.
+#define _GNU_SOURCE
+
+#include "file_io.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void *io_alloc(size_t size)
+{
+  void *buf;
+  if (posix_memalign(&buf, IO_ALIGN, size) != 0)
+  {
+    return NULL;
+  }
+  return buf;
+}
+
+void io_buffer_reserve(struct io_buffer *b, size_t cap)
+{
+  if (cap <= b->cap)
+  {
+    return;
+  }
+
+  // Round up to whole pages, and at least double, so a buffer that
+  // keeps growing is only copied a few times.
+  size_t new_cap = b->cap * 2 > cap ? b->cap * 2 : cap;
+  new_cap = (new_cap + IO_ALIGN - 1) & ~((size_t)IO_ALIGN - 1);
+
+  char *data = io_alloc(new_cap);
+  if (data == NULL)
+  {
+    err(1, "io_alloc() failed");
+  }
+  if (b->len > 0)
+  {
+    memcpy(data, b->data, b->len);
+  }
+  free(b->data);
+
+  b->data = data;
+  b->cap = new_cap;
+}
+
+void io_buffer_append(struct io_buffer *b, const char *data, size_t len)
+{
+  io_buffer_reserve(b, b->len + len);
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+void io_buffer_free(struct io_buffer *b)
+{
+  free(b->data);
+  b->data = NULL;
+  b->len = 0;
+  b->cap = 0;
+}
+
+void file_id_stat(struct file_id *id, const struct stat *st)
+{
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->size = st->st_size;
+  id->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int file_id_equal(const struct file_id *a, const struct file_id *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime_ns == b->mtime_ns;
+}
+
+int file_cache_mode(off_t size, int cache_neutral)
+{
+  if (!cache_neutral)
+  {
+    return FILE_CACHED;
+  }
+  return size >= CACHE_NEUTRAL_MIN_SIZE ? FILE_DIRECT : FILE_DROP_BEHIND;
+}
+
+int file_open(const char *path, int *mode)
+{
+  if (*mode == FILE_DIRECT)
+  {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (fd >= 0 || errno != EINVAL)
+    {
+      return fd;
+    }
+
+    // EINVAL means the file system (tmpfs, for one) does not do
+    // O_DIRECT.
+    *mode = FILE_DROP_BEHIND;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && *mode == FILE_DROP_BEHIND)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return fd;
+}
+
+void file_drop_behind(int fd, off_t *dropped, off_t offset)
+{
+  if (offset < 0)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  else if (offset - *dropped >= CACHE_DROP_STEP)
+  {
+    posix_fadvise(fd, *dropped, offset - *dropped, POSIX_FADV_DONTNEED);
+    *dropped = offset;
+  }
+}
+
+int file_read(int fd, char *buf, size_t size, off_t offset, int mode, file_data_fn data,
+              void *arg)
+{
+  int drop_behind = mode == FILE_DROP_BEHIND;
+  off_t dropped = offset;
+  int error = 0;
+
+  while (1)
+  {
+    ssize_t n = pread(fd, buf, size, offset);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      error = errno;
+      break;
+    }
+
+    if (n == 0 || data(arg, buf, n) != 0)
+    {
+      break;
+    }
+
+    offset += n;
+    if (drop_behind)
+    {
+      file_drop_behind(fd, &dropped, offset);
+    }
+  }
+
+  if (drop_behind)
+  {
+    file_drop_behind(fd, &dropped, -1);
+  }
+
+  return error;
+}
+
+int file_write(int fd, const char *data, size_t len)
+{
+  for (size_t done = 0; done < len;)
+  {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int file_writev(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return errno;
+    }
+
+    // Skip what was written, which may end in the middle of a piece.
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
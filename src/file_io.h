@@ -0,0 +1,97 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Buffers, file offsets and read sizes must all be multiples of this
+// when a file is opened with O_DIRECT.
+#define IO_ALIGN 4096
+
+// In cache-neutral mode, files at least this large are read with
+// O_DIRECT, so they never enter the page cache at all.
+#define CACHE_NEUTRAL_MIN_SIZE (1024 * 1024)
+
+// When O_DIRECT is not possible, we tell the kernel to drop the pages
+// we have already read in steps of this many bytes.
+#define CACHE_DROP_STEP (8 * 1024 * 1024)
+
+// Called with each block read from a file, in file order.  Returning
+// non-zero stops reading the file early.
+typedef int (*file_data_fn)(void *arg, const char *buf, size_t len);
+
+// How a file is read with respect to the page cache.
+enum file_cache_mode
+{
+  FILE_CACHED,      // Ordinary reads.
+  FILE_DROP_BEHIND, // Ordinary reads, dropping pages behind the cursor.
+  FILE_DIRECT,      // O_DIRECT reads that bypass the cache.
+};
+
+// A buffer that is kept around and reused from file to file.  It only
+// ever grows, so once it has reached its working size we stop
+// allocating memory for it altogether.
+struct io_buffer
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+// What tells whether a file has changed since we last saw it.  If none
+// of it has, we take it that the contents have not either.
+struct file_id
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+};
+
+void file_id_stat(struct file_id *id, const struct stat *st);
+
+int file_id_equal(const struct file_id *a, const struct file_id *b);
+
+// Allocate an IO_ALIGN aligned buffer, suitable for O_DIRECT.
+void *io_alloc(size_t size);
+
+// Make room for at least 'cap' bytes, keeping the contents.
+void io_buffer_reserve(struct io_buffer *b, size_t cap);
+
+// Append 'len' bytes to the buffer, growing it if necessary.
+void io_buffer_append(struct io_buffer *b, const char *data, size_t len);
+
+void io_buffer_free(struct io_buffer *b);
+
+// Decide how to read a file of the given size.
+int file_cache_mode(off_t size, int cache_neutral);
+
+// Open a file for reading in the given mode.  If the file system does
+// not support O_DIRECT, '*mode' is downgraded to FILE_DROP_BEHIND.
+// Returns -1 with errno set on failure.
+int file_open(const char *path, int *mode);
+
+// Drop the cached pages of 'fd' that lie before 'offset', once at least
+// CACHE_DROP_STEP new bytes have been read.  '*dropped' keeps track of
+// how far we got.  With 'offset' equal to -1, drop everything.
+void file_drop_behind(int fd, off_t *dropped, off_t offset);
+
+// Read 'fd' from 'offset' to the end through 'buf', which must be
+// IO_ALIGN aligned and 'size' a multiple of IO_ALIGN; so must 'offset'
+// in FILE_DIRECT mode.  In FILE_DROP_BEHIND mode, pages are dropped
+// from the cache as we go.  Returns 0, or an errno value if a read
+// failed.
+int file_read(int fd, char *buf, size_t size, off_t offset, int mode, file_data_fn data,
+              void *arg);
+
+// Write all of 'data' to 'fd', retrying short writes.  Returns 0, or
+// an errno value if a write failed.
+int file_write(int fd, const char *data, size_t len);
+
+// The same for 'iovcnt' pieces, with writev().  'iov' is used up.
+int file_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif
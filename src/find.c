@@ -0,0 +1,489 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as memmem()) on GNU/Linux systems.
+#define _GNU_SOURCE
+
+#include "find.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FIND_X86 1
+#endif
+
+// Bytes that are common in text and source code, most common first.
+// Everything else is assumed to be rare.
+static const char common_bytes[] = " etaoinsrlhdcu\n\tmfpgwybv,.;()_=\"ETAOINSRLHDCUMFPGWYBV"
+                                   "0123456789kxjqz-/*{}:<>'KXJQZ";
+
+// Higher is more common.
+static int byte_rank(char c)
+{
+  const char *p = c == '\0' ? NULL : strchr(common_bytes, c);
+  return p == NULL ? 0 : (int)(sizeof(common_bytes) - (p - common_bytes));
+}
+
+static int needle_rank(const struct searcher *s, size_t i)
+{
+  unsigned char c = s->needle[i];
+  if (s->nocase && is_letter(c))
+  {
+    return byte_rank(c | 0x20) + byte_rank(c & ~0x20);
+  }
+  return byte_rank(c);
+}
+
+// With -i, what to OR into the haystack byte that is compared with the
+// needle's i'th byte: 0x20 for letters, which turns A-Z into a-z, and
+// nothing for anything else.
+static unsigned char case_mask(const struct searcher *s, size_t i)
+{
+  return s->nocase && is_letter(s->needle[i]) ? 0x20 : 0;
+}
+
+static int needle_equal(const struct searcher *s, const char *p)
+{
+  if (!s->nocase)
+  {
+    return memcmp(p, s->needle, s->len) == 0;
+  }
+  for (size_t i = 0; i < s->len; i++)
+  {
+    if (fold_byte(p[i]) != fold_byte(s->needle[i]))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const char *find_byte(const struct searcher *s, const char *haystack, size_t len)
+{
+  return memchr(haystack, s->needle[0], len);
+}
+
+static const char *find_horspool(const struct searcher *s, const char *haystack, size_t len)
+{
+  size_t n = s->len;
+
+  for (size_t i = 0; i + n <= len; i += s->skip[fold_byte(haystack[i + n - 1])])
+  {
+    if (needle_equal(s, haystack + i))
+    {
+      return haystack + i;
+    }
+  }
+  return NULL;
+}
+
+// Whatever is too short for a vector.
+static const char *find_tail(const struct searcher *s, const char *haystack, size_t len)
+{
+  if (s->nocase)
+  {
+    return find_horspool(s, haystack, len);
+  }
+  return memmem(haystack, len, s->needle, s->len);
+}
+
+#ifdef FIND_X86
+
+// Check the candidates in 'mask', where bit i set means that the rare
+// bytes of the needle match at p + i.
+static inline const char *find_verify(const struct searcher *s, const char *p, unsigned mask)
+{
+  while (mask != 0)
+  {
+    int i = __builtin_ctz(mask);
+    if (needle_equal(s, p + i))
+    {
+      return p + i;
+    }
+    mask &= mask - 1;
+  }
+  return NULL;
+}
+
+// The short kernels compare offsets 0, 1, n - 2 and n - 1, which
+// between them cover every byte of a needle of up to 4 bytes.  Each
+// haystack byte is ORed with the case mask of the needle byte it is
+// compared with, so with -i a letter lane matches either case at no
+// extra cost.
+
+__attribute__((target("sse2"))) static const char *
+find_short_sse2(const struct searcher *s, const char *haystack, size_t len)
+{
+  size_t n = s->len;
+  if (len < n)
+  {
+    return NULL;
+  }
+
+  size_t o[4] = {0, n > 1 ? 1 : 0, n > 2 ? n - 2 : 0, n - 1};
+  __m128i fold[4], want[4];
+  for (int k = 0; k < 4; k++)
+  {
+    fold[k] = _mm_set1_epi8(case_mask(s, o[k]));
+    want[k] = _mm_set1_epi8(s->needle[o[k]] | case_mask(s, o[k]));
+  }
+
+  const char *p = haystack;
+  // One past the last position the needle can start at.
+  const char *stop = haystack + len - n + 1;
+
+  for (; stop - p >= 16; p += 16)
+  {
+    __m128i b0 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + o[0])), fold[0]);
+    __m128i b1 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + o[1])), fold[1]);
+    __m128i b2 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + o[2])), fold[2]);
+    __m128i b3 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + o[3])), fold[3]);
+    __m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, want[0]),
+                                             _mm_cmpeq_epi8(b1, want[1])),
+                               _mm_and_si128(_mm_cmpeq_epi8(b2, want[2]),
+                                             _mm_cmpeq_epi8(b3, want[3])));
+    unsigned mask = _mm_movemask_epi8(eq);
+    if (mask != 0)
+    {
+      return p + __builtin_ctz(mask);
+    }
+  }
+
+  return find_tail(s, p, haystack + len - p);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_short_avx2(const struct searcher *s, const char *haystack, size_t len)
+{
+  size_t n = s->len;
+  if (len < n)
+  {
+    return NULL;
+  }
+
+  size_t o[4] = {0, n > 1 ? 1 : 0, n > 2 ? n - 2 : 0, n - 1};
+  __m256i fold[4], want[4];
+  for (int k = 0; k < 4; k++)
+  {
+    fold[k] = _mm256_set1_epi8(case_mask(s, o[k]));
+    want[k] = _mm256_set1_epi8(s->needle[o[k]] | case_mask(s, o[k]));
+  }
+
+  const char *p = haystack;
+  const char *stop = haystack + len - n + 1;
+
+  for (; stop - p >= 32; p += 32)
+  {
+    __m256i b0 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + o[0])), fold[0]);
+    __m256i b1 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + o[1])), fold[1]);
+    __m256i b2 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + o[2])), fold[2]);
+    __m256i b3 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + o[3])), fold[3]);
+    __m256i eq = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, want[0]),
+                                                   _mm256_cmpeq_epi8(b1, want[1])),
+                                  _mm256_and_si256(_mm256_cmpeq_epi8(b2, want[2]),
+                                                   _mm256_cmpeq_epi8(b3, want[3])));
+    unsigned mask = _mm256_movemask_epi8(eq);
+    if (mask != 0)
+    {
+      return p + __builtin_ctz(mask);
+    }
+  }
+
+  return find_short_sse2(s, p, haystack + len - p);
+}
+
+__attribute__((target("sse2"))) static const char *
+find_long_sse2(const struct searcher *s, const char *haystack, size_t len)
+{
+  size_t n = s->len;
+  if (len < n)
+  {
+    return NULL;
+  }
+
+  const __m128i fold1 = _mm_set1_epi8(case_mask(s, s->rare1));
+  const __m128i fold2 = _mm_set1_epi8(case_mask(s, s->rare2));
+  const __m128i want1 = _mm_set1_epi8(s->needle[s->rare1] | case_mask(s, s->rare1));
+  const __m128i want2 = _mm_set1_epi8(s->needle[s->rare2] | case_mask(s, s->rare2));
+  const char *p = haystack;
+  const char *stop = haystack + len - n + 1;
+
+  for (; stop - p >= 16; p += 16)
+  {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + s->rare1)), fold1);
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + s->rare2)), fold2);
+    unsigned mask =
+        _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, want1), _mm_cmpeq_epi8(b, want2)));
+    const char *hit = find_verify(s, p, mask);
+    if (hit != NULL)
+    {
+      return hit;
+    }
+  }
+
+  return find_tail(s, p, haystack + len - p);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_long_avx2(const struct searcher *s, const char *haystack, size_t len)
+{
+  size_t n = s->len;
+  if (len < n)
+  {
+    return NULL;
+  }
+
+  const __m256i fold1 = _mm256_set1_epi8(case_mask(s, s->rare1));
+  const __m256i fold2 = _mm256_set1_epi8(case_mask(s, s->rare2));
+  const __m256i want1 = _mm256_set1_epi8(s->needle[s->rare1] | case_mask(s, s->rare1));
+  const __m256i want2 = _mm256_set1_epi8(s->needle[s->rare2] | case_mask(s, s->rare2));
+  const char *p = haystack;
+  const char *stop = haystack + len - n + 1;
+
+  for (; stop - p >= 32; p += 32)
+  {
+    __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + s->rare1)), fold1);
+    __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + s->rare2)), fold2);
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, want1), _mm256_cmpeq_epi8(b, want2)));
+    const char *hit = find_verify(s, p, mask);
+    if (hit != NULL)
+    {
+      return hit;
+    }
+  }
+
+  return find_long_sse2(s, p, haystack + len - p);
+}
+
+#endif
+
+void searcher_init(struct searcher *s, const char *needle, size_t len, int nocase)
+{
+  s->needle = needle;
+  s->len = len;
+  s->nocase = nocase;
+
+  // Pick the two rarest bytes, at different offsets.
+  s->rare1 = 0;
+  s->rare2 = len > 1 ? 1 : 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (needle_rank(s, i) < needle_rank(s, s->rare1))
+    {
+      s->rare1 = i;
+    }
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    if (i != s->rare1 && (s->rare2 == s->rare1 || needle_rank(s, i) < needle_rank(s, s->rare2)))
+    {
+      s->rare2 = i;
+    }
+  }
+
+  // The shifts are looked up by folded byte, which costs the
+  // case-sensitive search a little distance now and then, but is
+  // correct either way.
+  for (int c = 0; c < 256; c++)
+  {
+    s->skip[c] = len;
+  }
+  for (size_t i = 0; i + 1 < len; i++)
+  {
+    s->skip[fold_byte(needle[i])] = len - 1 - i;
+  }
+
+  if (len == 0)
+  {
+    s->find = find_tail;
+    return;
+  }
+  if (len == 1 && !(nocase && is_letter(needle[0])))
+  {
+    s->find = find_byte;
+    return;
+  }
+
+  s->find = len <= 4 && !nocase ? find_tail : find_horspool;
+#ifdef FIND_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    s->find = len <= 4 ? find_short_avx2 : find_long_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    s->find = len <= 4 ? find_short_sse2 : find_long_sse2;
+  }
+#endif
+}
+
+static void searcher_reset(const void *impl, struct matcher_cursor *c, const char *pos)
+{
+  (void)impl;
+  c->pos = pos;
+}
+
+static int searcher_next(const void *impl, struct matcher_cursor *c, const char *end,
+                         struct match *m)
+{
+  const struct searcher *s = impl;
+
+  if (c->pos > end)
+  {
+    return 0;
+  }
+
+  const char *hit = searcher_find(s, c->pos, end - c->pos);
+  if (hit == NULL)
+  {
+    c->pos = end + 1;
+    return 0;
+  }
+
+  m->start = hit;
+  m->end = hit + s->len;
+  m->id = 0;
+  c->pos = hit + 1;
+  return 1;
+}
+
+void searcher_matcher(const struct searcher *s, struct matcher *m)
+{
+  m->impl = s;
+  m->num_patterns = 1;
+  m->reset = searcher_reset;
+  m->next = searcher_next;
+}
+
+// Newlines are counted a vector at a time: comparing with '\n' gives
+// 0xff, that is -1, in every lane that has one, so subtracting the
+// comparison adds one to that lane.  A lane can count up to 255 before
+// it overflows, so every so often we add the lanes up with psadbw.  A
+// final partial vector is loaded so that it ends at the end of the
+// buffer, and the bytes it shares with the last full one are shifted
+// out of its movemask before we popcount it.
+
+static size_t count_newlines_scalar(const char *p, size_t len)
+{
+  size_t n = 0;
+  const char *end = p + len;
+  while ((p = memchr(p, '\n', end - p)) != NULL)
+  {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+#ifdef FIND_X86
+
+__attribute__((target("sse2"))) static size_t count_newlines_sse2(const char *p, size_t len)
+{
+  if (len < 16)
+  {
+    return count_newlines_scalar(p, len);
+  }
+
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i zero = _mm_setzero_si128();
+  const char *end = p + len;
+  size_t n = 0;
+
+  while (end - p >= 16)
+  {
+    __m128i sum = zero;
+    size_t blocks = (end - p) / 16 < 255 ? (end - p) / 16 : 255;
+    for (size_t i = 0; i < blocks; i++, p += 16)
+    {
+      sum = _mm_sub_epi8(sum, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    }
+    __m128i sad = _mm_sad_epu8(sum, zero);
+    n += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+  }
+
+  if (p < end)
+  {
+    unsigned mask =
+      _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(end - 16)), nl));
+    n += __builtin_popcount(mask >> (16 - (end - p)));
+  }
+  return n;
+}
+
+__attribute__((target("avx2"))) static size_t count_newlines_avx2(const char *p, size_t len)
+{
+  if (len < 32)
+  {
+    return count_newlines_sse2(p, len);
+  }
+
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i zero = _mm256_setzero_si256();
+  const char *end = p + len;
+  size_t n = 0;
+
+  // Four vectors at a time, so a lane can take 63 rounds.
+  while (end - p >= 128)
+  {
+    __m256i sum = zero;
+    size_t rounds = (end - p) / 128 < 63 ? (end - p) / 128 : 63;
+    for (size_t i = 0; i < rounds; i++, p += 128)
+    {
+      __m256i e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl);
+      __m256i e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), nl);
+      __m256i e2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 64)), nl);
+      __m256i e3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 96)), nl);
+      sum = _mm256_sub_epi8(sum,
+                            _mm256_add_epi8(_mm256_add_epi8(e0, e1), _mm256_add_epi8(e2, e3)));
+    }
+    __m256i sad = _mm256_sad_epu8(sum, zero);
+    n += _mm256_extract_epi32(sad, 0) + _mm256_extract_epi32(sad, 2) +
+         _mm256_extract_epi32(sad, 4) + _mm256_extract_epi32(sad, 6);
+  }
+
+  for (; end - p >= 32; p += 32)
+  {
+    n += __builtin_popcount(
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl)));
+  }
+
+  if (p < end)
+  {
+    unsigned mask = _mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(end - 32)), nl));
+    n += __builtin_popcount(mask >> (32 - (end - p)));
+  }
+  return n;
+}
+
+#endif
+
+static size_t count_newlines_resolve(const char *p, size_t len);
+
+// Picked on the first call.  Every thread that races to pick it picks
+// the same one.
+static size_t (*count_newlines_fn)(const char *p, size_t len) = count_newlines_resolve;
+
+static size_t count_newlines_resolve(const char *p, size_t len)
+{
+  size_t (*fn)(const char *, size_t) = count_newlines_scalar;
+#ifdef FIND_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    fn = count_newlines_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    fn = count_newlines_sse2;
+  }
+#endif
+  __atomic_store_n(&count_newlines_fn, fn, __ATOMIC_RELAXED);
+  return fn(p, len);
+}
+
+size_t count_newlines(const char *p, size_t len)
+{
+  return __atomic_load_n(&count_newlines_fn, __ATOMIC_RELAXED)(p, len);
+}
@@ -0,0 +1,79 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <stddef.h>
+
+#include "matcher.h"
+
+struct searcher;
+
+static inline int is_letter(unsigned char c)
+{
+  return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+// Turn ASCII upper case letters into lower case ones, and leave
+// everything else alone.
+static inline unsigned char fold_byte(unsigned char c)
+{
+  return is_letter(c) ? c | 0x20 : c;
+}
+
+typedef const char *(*searcher_fn)(const struct searcher *s, const char *haystack, size_t len);
+
+// A needle compiled for fast searching.  It is set up once, and is
+// only read afterwards, so any number of threads can share it.
+//
+// How we search depends on the length of the needle:
+//
+//  - A single byte is left to memchr().
+//
+//  - Needles of 2 to 4 bytes are compared in full against 32 (AVX2) or
+//    16 (SSE2) positions of the haystack at a time, so every candidate
+//    is a match.
+//
+//  - For longer needles we look for the two rarest bytes of the needle
+//    at their offsets, and memcmp() the positions where both occur.
+//
+// The kernel is picked by searcher_init() based on what the CPU
+// supports.  Without SIMD, long needles use Boyer-Moore-Horspool.
+//
+// With 'nocase', ASCII letters match either case.  The kernels handle
+// this by ORing 0x20 into the haystack bytes they compare with letters
+// of the needle, rather than by making lower case copies of anything.
+struct searcher
+{
+  const char *needle;
+  size_t len;
+
+  // Offsets of the two rarest bytes in the needle.
+  size_t rare1, rare2;
+
+  // Boyer-Moore-Horspool shifts, indexed by the (folded) haystack byte
+  // under the last byte of the needle.
+  size_t skip[256];
+
+  // Ignore the case of ASCII letters.
+  int nocase;
+
+  searcher_fn find;
+};
+
+void searcher_init(struct searcher *s, const char *needle, size_t len, int nocase);
+
+// Return a pointer to the first occurrence of the needle in the
+// haystack, or NULL if there is none, just like memmem().
+static inline const char *searcher_find(const struct searcher *s, const char *haystack,
+                                        size_t len)
+{
+  return s->find(s, haystack, len);
+}
+
+// Set up 'm' to search for the needle.
+void searcher_matcher(const struct searcher *s, struct matcher *m);
+
+// The number of newlines in the 'len' bytes at 'p', counted with SIMD
+// where the CPU has it.
+size_t count_newlines(const char *p, size_t len);
+
+#endif
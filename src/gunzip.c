@@ -0,0 +1,126 @@
+#include "gunzip.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+void gunzip_init(struct gunzip *gz)
+{
+  memset(gz, 0, sizeof(*gz));
+  gz->state = GUNZIP_PLAIN;
+}
+
+void gunzip_destroy(struct gunzip *gz)
+{
+  if (gz->inflating)
+  {
+    inflateEnd(&gz->z);
+  }
+  free(gz->out);
+}
+
+void gunzip_start(struct gunzip *gz, int detect, file_data_fn data, void *arg)
+{
+  gz->state = detect ? GUNZIP_DETECT : GUNZIP_PLAIN;
+  gz->stopped = 0;
+  gz->data = data;
+  gz->arg = arg;
+}
+
+// Start on a gzip member.
+static void start_member(struct gunzip *gz)
+{
+  if (gz->out == NULL && (gz->out = malloc(GUNZIP_BLOCK_SIZE)) == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+
+  // 16 more window bits is zlib for a gzip header and trailer.
+  int ret = gz->inflating ? inflateReset(&gz->z) : inflateInit2(&gz->z, 16 + MAX_WBITS);
+  if (ret != Z_OK)
+  {
+    errx(1, "inflateInit2() failed");
+  }
+  gz->inflating = 1;
+  gz->state = GUNZIP_MEMBER;
+}
+
+static int inflate_block(struct gunzip *gz, const char *buf, size_t len)
+{
+  gz->z.next_in = (Bytef *)buf;
+  gz->z.avail_in = len;
+
+  // A full output buffer may leave more to come even once all the
+  // input is in.
+  do
+  {
+    if (gz->state == GUNZIP_BETWEEN)
+    {
+      start_member(gz);
+    }
+
+    gz->z.next_out = (Bytef *)gz->out;
+    gz->z.avail_out = GUNZIP_BLOCK_SIZE;
+    int ret = inflate(&gz->z, Z_NO_FLUSH);
+    if (ret == Z_BUF_ERROR)
+    {
+      // The last round filled the buffer exactly, and there turned out
+      // to be nothing more until the next block.  If there is no next
+      // block, gunzip_finish() tells.
+      break;
+    }
+    if (ret == Z_STREAM_END)
+    {
+      gz->state = GUNZIP_BETWEEN;
+    }
+    else if (ret != Z_OK)
+    {
+      gz->state = GUNZIP_BROKEN;
+    }
+
+    size_t n = GUNZIP_BLOCK_SIZE - gz->z.avail_out;
+    if (n > 0 && gz->data(gz->arg, gz->out, n))
+    {
+      gz->stopped = 1;
+      return 1;
+    }
+    if (gz->state == GUNZIP_BROKEN)
+    {
+      return 1;
+    }
+  } while (gz->z.avail_in > 0 || (gz->state == GUNZIP_MEMBER && gz->z.avail_out == 0));
+
+  return 0;
+}
+
+int gunzip_block(void *arg, const char *buf, size_t len)
+{
+  struct gunzip *gz = arg;
+  if (gz->state == GUNZIP_DETECT)
+  {
+    if (gunzip_magic(buf, len))
+    {
+      start_member(gz);
+    }
+    else
+    {
+      gz->state = GUNZIP_PLAIN;
+    }
+  }
+
+  if (gz->state == GUNZIP_PLAIN)
+  {
+    return gz->data(gz->arg, buf, len);
+  }
+  return inflate_block(gz, buf, len);
+}
+
+int gunzip_finish(struct gunzip *gz)
+{
+  // Where the consumer stopped us, the rest is of no interest.
+  if (gz->state == GUNZIP_BROKEN || (gz->state == GUNZIP_MEMBER && !gz->stopped))
+  {
+    return -1;
+  }
+  return 0;
+}
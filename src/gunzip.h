@@ -0,0 +1,70 @@
+#ifndef GUNZIP_H
+#define GUNZIP_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "file_io.h"
+
+// Searching inside gzip files as they are read, with no temporary
+// files.  A gunzip sits between a reader and whatever wants the
+// file's blocks.  A file that starts with the gzip magic bytes is
+// inflated a block at a time into a buffer of GUNZIP_BLOCK_SIZE bytes,
+// which is kept from file to file, and the blocks of uncompressed data
+// are passed on.  Any other file passes through as it is.
+//
+// A file of several gzip members, as cat makes of two, is inflated as
+// the concatenation of their contents, like gzip -d does.
+#define GUNZIP_BLOCK_SIZE (256 * 1024)
+
+#define GZIP_MAGIC_0 0x1f
+#define GZIP_MAGIC_1 0x8b
+
+enum gunzip_state
+{
+  GUNZIP_DETECT,  // Nothing seen yet.
+  GUNZIP_PLAIN,   // Not compressed.
+  GUNZIP_MEMBER,  // In the middle of a gzip member.
+  GUNZIP_BETWEEN, // At the end of one.
+  GUNZIP_BROKEN,  // Not valid gzip data after all.
+};
+
+struct gunzip
+{
+  enum gunzip_state state;
+  int stopped; // The consumer did not want any more.
+  file_data_fn data;
+  void *arg;
+
+  // Only allocated once a gzip file comes along.
+  int inflating;
+  z_stream z;
+  char *out;
+};
+
+// Whether 'len' bytes at 'buf', from the start of a file, are those of
+// a gzip file.
+static inline int gunzip_magic(const char *buf, size_t len)
+{
+  return len >= 2 && (unsigned char)buf[0] == GZIP_MAGIC_0 &&
+         (unsigned char)buf[1] == GZIP_MAGIC_1;
+}
+
+void gunzip_init(struct gunzip *gz);
+
+void gunzip_destroy(struct gunzip *gz);
+
+// Start on a file, whose blocks, uncompressed, go to 'data' with
+// 'arg'.  Without 'detect', blocks pass through whatever they hold,
+// as they must for a file that is not read from the start.
+void gunzip_start(struct gunzip *gz, int detect, file_data_fn data, void *arg);
+
+// A file_data_fn for the reader, with the gunzip as 'arg'.
+int gunzip_block(void *arg, const char *buf, size_t len);
+
+// Once the whole file has been read: returns 0, or -1 if its
+// compressed data was invalid or cut short, in which case only what
+// came before that has been passed on.
+int gunzip_finish(struct gunzip *gz);
+
+#endif
@@ -0,0 +1,162 @@
+#include "holdback.h"
+
+#include <err.h>
+#include <stdlib.h>
+
+void holdback_init(struct holdback *h, holdback_write_fn write, void *arg)
+{
+  pthread_mutex_init(&h->lock, NULL);
+  h->write = write;
+  h->arg = arg;
+  h->owned = 0;
+  h->owner = 0;
+  h->held = NULL;
+  h->done = NULL;
+  h->done_tail = NULL;
+  h->free_files = NULL;
+}
+
+static void free_list(struct holdback_file *f)
+{
+  while (f != NULL)
+  {
+    struct holdback_file *next = f->next;
+    io_buffer_free(&f->out);
+    free(f);
+    f = next;
+  }
+}
+
+void holdback_destroy(struct holdback *h)
+{
+  free_list(h->held);
+  free_list(h->done);
+  free_list(h->free_files);
+  pthread_mutex_destroy(&h->lock);
+}
+
+static void put_file(struct holdback *h, struct holdback_file *f)
+{
+  f->next = h->free_files;
+  h->free_files = f;
+}
+
+// Take the output of a file that is not the owner.
+static void hold(struct holdback *h, long seq, struct io_buffer *out, int last)
+{
+  struct holdback_file **p = &h->held;
+  while (*p != NULL && (*p)->seq != seq)
+  {
+    p = &(*p)->next;
+  }
+
+  struct holdback_file *f = *p;
+  if (f == NULL)
+  {
+    if (out->len == 0)
+    {
+      return;
+    }
+    f = h->free_files;
+    if (f != NULL)
+    {
+      h->free_files = f->next;
+    }
+    else if ((f = calloc(1, sizeof(*f))) == NULL)
+    {
+      err(1, "calloc() failed");
+    }
+    f->next = NULL;
+    f->seq = seq;
+    *p = f;
+  }
+
+  // An empty buffer of ours is as good as the caller's.
+  if (f->out.len == 0)
+  {
+    struct io_buffer tmp = f->out;
+    f->out = *out;
+    *out = tmp;
+  }
+  else
+  {
+    io_buffer_append(&f->out, out->data, out->len);
+    out->len = 0;
+  }
+
+  if (last)
+  {
+    *p = f->next;
+    f->next = NULL;
+    if (h->done_tail != NULL)
+    {
+      h->done_tail->next = f;
+    }
+    else
+    {
+      h->done = f;
+    }
+    h->done_tail = f;
+  }
+}
+
+// The owner is done.  Write out the finished files, and hand over to
+// the first of the others.  Until then there is still an owner, so the
+// others come to us rather than skip holdback_write().
+static void release(struct holdback *h)
+{
+  while (h->done != NULL)
+  {
+    struct holdback_file *f = h->done;
+    h->done = f->next;
+    h->write(h->arg, &f->out);
+    put_file(h, f);
+  }
+  h->done_tail = NULL;
+
+  if (h->held != NULL)
+  {
+    struct holdback_file *f = h->held;
+    h->held = f->next;
+    h->write(h->arg, &f->out);
+    h->owner = f->seq;
+    put_file(h, f);
+  }
+  else
+  {
+    __atomic_store_n(&h->owned, 0, __ATOMIC_RELAXED);
+  }
+}
+
+void holdback_write(struct holdback *h, long seq, struct io_buffer *out, int last)
+{
+  // With no owner, nothing is held either, so a file with nothing to
+  // say has nothing to see to.
+  if (out->len == 0 && !__atomic_load_n(&h->owned, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&h->lock);
+  if (!h->owned || h->owner == seq)
+  {
+    if (out->len > 0)
+    {
+      h->write(h->arg, out);
+      if (!last)
+      {
+        h->owner = seq;
+        __atomic_store_n(&h->owned, 1, __ATOMIC_RELAXED);
+      }
+    }
+    if (last && h->owned && h->owner == seq)
+    {
+      release(h);
+    }
+  }
+  else
+  {
+    hold(h, seq, out, last);
+  }
+  pthread_mutex_unlock(&h->lock);
+}
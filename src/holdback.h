@@ -0,0 +1,54 @@
+#ifndef HOLDBACK_H
+#define HOLDBACK_H
+
+#include <pthread.h>
+
+#include "file_io.h"
+
+// Keeps the output of each file together, in whatever order the files
+// finish, when files may write it in several pieces.
+//
+// The first file to write a piece before it is done becomes the owner,
+// and writes its pieces straight away until its last one.  Meanwhile
+// any other file's output is held back, and written once the owner is
+// done: that of files that have finished, in the order they did, and
+// then that of the first one still going, which becomes the next
+// owner.  Nobody waits for the owner, so a worker can always go on
+// with the files it has, and finish the owner's too.  The price is
+// that the held output is kept in memory, however much there is.
+
+// Writes out the contents of 'b', leaving it empty.
+typedef void (*holdback_write_fn)(void *arg, struct io_buffer *b);
+
+struct holdback_file
+{
+  struct holdback_file *next;
+  long seq;
+  struct io_buffer out;
+};
+
+struct holdback
+{
+  pthread_mutex_t lock;
+  holdback_write_fn write;
+  void *arg;
+
+  int owned;
+  long owner;
+
+  struct holdback_file *held; // Files still going, in the order they started.
+  struct holdback_file *done; // Files finished, in the order they did.
+  struct holdback_file *done_tail;
+  struct holdback_file *free_files; // Kept for reuse, with their buffers.
+};
+
+void holdback_init(struct holdback *h, holdback_write_fn write, void *arg);
+
+void holdback_destroy(struct holdback *h);
+
+// Output for file number 'seq', to follow whatever it had before,
+// which is taken from 'out' and leaves it empty.  With 'last', the file
+// has no more, and 'out' may well be empty.
+void holdback_write(struct holdback *h, long seq, struct io_buffer *out, int last);
+
+#endif
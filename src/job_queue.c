@@ -91,15 +91,13 @@ int job_queue_push(struct job_queue *job_queue, void *data)
   return 0;
 }
 
-int job_queue_pop(struct job_queue *job_queue, void **data)
-{
-  //Thread-local flag to track active job
-  static __thread int has_active_job = 0;
-
-  //Lock to prevent multiple workers taking same job
-  pthread_mutex_lock(&job_queue->lock);
+//Thread-local flag to track active job
+static __thread int has_active_job = 0;
 
-  // If returning after a job -> signal the job is completed, and decrement activeworker count
+// If returning after a job -> signal the job is completed, and decrement activeworker count.
+// Must be called with the lock held.
+static void job_queue_finish_job(struct job_queue *job_queue)
+{
   if (has_active_job)
   {
     job_queue->active_workers--;
@@ -111,6 +109,30 @@ int job_queue_pop(struct job_queue *job_queue, void **data)
       pthread_cond_signal(&job_queue->done_cond);
     }
   }
+}
+
+// Take the job at the front.  Must be called with the lock held and a non-empty queue.
+static void job_queue_take_job(struct job_queue *job_queue, void **data)
+{
+  //Read item at front and advance
+  *data = job_queue->jobs[job_queue->front].arg;
+  job_queue->front = (job_queue->front + 1) % job_queue->capacity;
+  job_queue->size--;
+
+  //Mark this thread as active worker
+  job_queue->active_workers++;
+  has_active_job = 1;
+
+  //Notify a threat that space exists
+  pthread_cond_signal(&job_queue->full_cond);
+}
+
+int job_queue_pop(struct job_queue *job_queue, void **data)
+{
+  //Lock to prevent multiple workers taking same job
+  pthread_mutex_lock(&job_queue->lock);
+
+  job_queue_finish_job(job_queue);
 
   //Wait for work while not shutting down
   while (job_queue->size == 0 && !job_queue->destroyed)
@@ -125,21 +147,47 @@ int job_queue_pop(struct job_queue *job_queue, void **data)
     return -1;
   }
 
-  //Read item at front and advance
-  *data = job_queue->jobs[job_queue->front].arg;
-  job_queue->front = (job_queue->front + 1) % job_queue->capacity;
-  job_queue->size--;
+  job_queue_take_job(job_queue, data);
 
-  //Mark this thread as active worker
-  job_queue->active_workers++;
-  has_active_job = 1;
+  //Unlock the queue so other threads can continue
+  pthread_mutex_unlock(&job_queue->lock);
 
-  //Notify a threat that space exists
-  pthread_cond_signal(&job_queue->full_cond);
+  return 0;
+}
+
+int job_queue_trypop(struct job_queue *job_queue, void **data)
+{
+  pthread_mutex_lock(&job_queue->lock);
+
+  job_queue_finish_job(job_queue);
+
+  //Nothing there right now -> let the caller get on with other work
+  if (job_queue->size == 0)
+  {
+    int ret = job_queue->destroyed ? -1 : 1;
+    pthread_mutex_unlock(&job_queue->lock);
+    return ret;
+  }
+
+  job_queue_take_job(job_queue, data);
 
-  //Unlock the queue so other threads can continue
   pthread_mutex_unlock(&job_queue->lock);
 
   return 0;
 }
 
+void job_queue_peek(struct job_queue *job_queue, int n, int (*fn)(void *data, void *arg),
+                    void *arg)
+{
+  pthread_mutex_lock(&job_queue->lock);
+
+  for (int i = 0; i < n && i < job_queue->size; i++)
+  {
+    if (fn(job_queue->jobs[(job_queue->front + i) % job_queue->capacity].arg, arg) != 0)
+    {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&job_queue->lock);
+}
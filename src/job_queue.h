@@ -43,4 +43,15 @@ int job_queue_push(struct job_queue *job_queue, void *data);
 // job_queue_pop() blocked), this function will return -1.
 int job_queue_pop(struct job_queue *job_queue, void **data);
 
+// Like job_queue_pop(), but never blocks.  Returns 1 if the queue is
+// currently empty but has not been destroyed.
+int job_queue_trypop(struct job_queue *job_queue, void **data);
+
+// Call 'fn' on each of the first 'n' jobs in the queue, front first,
+// without removing them, until it returns non-zero.  The queue is
+// locked while 'fn' runs, so it must be quick, but it is also
+// guaranteed that no worker pops the job in the meantime.
+void job_queue_peek(struct job_queue *job_queue, int n, int (*fn)(void *data, void *arg),
+                    void *arg);
+
 #endif
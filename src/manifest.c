@@ -0,0 +1,120 @@
+// Setting _DEFAULT_SOURCE is necessary to activate visibility of
+// certain header file contents on GNU/Linux systems.
+#define _DEFAULT_SOURCE
+
+#include "manifest.h"
+
+#include <err.h>
+#include <fts.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static size_t add_path(struct manifest *m, const char *path)
+{
+  size_t offset = m->paths.len;
+  io_buffer_append(&m->paths, path, strlen(path) + 1);
+  return offset;
+}
+
+static void walk(struct manifest *m)
+{
+  m->paths.len = 0;
+  m->num_files = 0;
+  m->num_dirs = 0;
+
+  // The same walk as fauxgrep-mt does, so the files come in the same
+  // order.
+  FTS *ftsp;
+  if ((ftsp = fts_open(m->roots, FTS_LOGICAL | FTS_NOCHDIR, NULL)) == NULL)
+  {
+    err(1, "fts_open() failed");
+  }
+
+  FTSENT *p;
+  while ((p = fts_read(ftsp)) != NULL)
+  {
+    switch (p->fts_info)
+    {
+    case FTS_D:
+      if (m->num_dirs == m->dirs_cap)
+      {
+        m->dirs_cap = m->dirs_cap == 0 ? 64 : m->dirs_cap * 2;
+        if ((m->dirs = realloc(m->dirs, m->dirs_cap * sizeof(*m->dirs))) == NULL)
+        {
+          err(1, "realloc() failed");
+        }
+      }
+      m->dirs[m->num_dirs].path = add_path(m, p->fts_path);
+      m->dirs[m->num_dirs].mtime = p->fts_statp->st_mtim;
+      m->num_dirs++;
+      break;
+    case FTS_F:
+      if (m->num_files == m->files_cap)
+      {
+        m->files_cap = m->files_cap == 0 ? 1024 : m->files_cap * 2;
+        if ((m->files = realloc(m->files, m->files_cap * sizeof(*m->files))) == NULL)
+        {
+          err(1, "realloc() failed");
+        }
+      }
+      m->files[m->num_files++] = add_path(m, p->fts_path);
+      break;
+    default:
+      break;
+    }
+  }
+  fts_close(ftsp);
+}
+
+void manifest_init(struct manifest *m, char *const *roots)
+{
+  memset(m, 0, sizeof(*m));
+
+  size_t num_roots = 0;
+  while (roots[num_roots] != NULL)
+  {
+    num_roots++;
+  }
+  if ((m->roots = calloc(num_roots + 1, sizeof(char *))) == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+  for (size_t i = 0; i < num_roots; i++)
+  {
+    if ((m->roots[i] = strdup(roots[i])) == NULL)
+    {
+      err(1, "strdup() failed");
+    }
+  }
+
+  walk(m);
+}
+
+void manifest_destroy(struct manifest *m)
+{
+  for (size_t i = 0; m->roots[i] != NULL; i++)
+  {
+    free(m->roots[i]);
+  }
+  free(m->roots);
+  io_buffer_free(&m->paths);
+  free(m->files);
+  free(m->dirs);
+}
+
+int manifest_refresh(struct manifest *m)
+{
+  for (size_t i = 0; i < m->num_dirs; i++)
+  {
+    struct stat st;
+    const struct timespec *t = &m->dirs[i].mtime;
+    if (stat(m->paths.data + m->dirs[i].path, &st) != 0 || st.st_mtim.tv_sec != t->tv_sec ||
+        st.st_mtim.tv_nsec != t->tv_nsec)
+    {
+      walk(m);
+      return 1;
+    }
+  }
+  return 0;
+}
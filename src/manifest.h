@@ -0,0 +1,56 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "file_io.h"
+
+// The files under a set of paths, found once and kept, so that a
+// server need not walk the tree again for every search.  The files are
+// in the order a walk finds them.
+//
+// Each directory's modification time is kept as well.  Files come and
+// go only by changing their directory, so as long as none of those
+// has changed, neither has the list.  Otherwise the tree is walked
+// again.
+
+struct manifest_dir
+{
+  size_t path; // Offset into 'paths'.
+  struct timespec mtime;
+};
+
+struct manifest
+{
+  char **roots;
+
+  struct io_buffer paths; // Each NUL terminated.
+  size_t *files;          // Offsets into 'paths'.
+  size_t num_files;
+  size_t files_cap;
+  struct manifest_dir *dirs;
+  size_t num_dirs;
+  size_t dirs_cap;
+};
+
+// Walk 'roots', a NULL terminated array of paths.
+void manifest_init(struct manifest *m, char *const *roots);
+
+void manifest_destroy(struct manifest *m);
+
+// Walk the tree again if any directory has changed.  Returns non-zero
+// if it did.
+int manifest_refresh(struct manifest *m);
+
+static inline size_t manifest_num_files(const struct manifest *m)
+{
+  return m->num_files;
+}
+
+static inline const char *manifest_path(const struct manifest *m, size_t i)
+{
+  return m->paths.data + m->files[i];
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include <stddef.h>
+
+// The interface between the search module and whatever finds the
+// patterns: a single needle, a set of needles, and so on.
+
+struct match
+{
+  const char *start;
+  const char *end;
+  int id; // Which pattern matched, counting from 0.
+};
+
+// Where a matcher is in the buffer.  Apart from 'pos', what the fields
+// mean is up to the matcher.
+struct matcher_cursor
+{
+  const char *pos;
+  int state;
+  int out;
+  int id;
+};
+
+// Start looking for matches at 'pos'.
+typedef void (*matcher_reset_fn)(const void *impl, struct matcher_cursor *c, const char *pos);
+
+// Find the next match that ends at or before 'end', and return 1, or
+// return 0 if there are no more.  Matches are returned in the order in
+// which they start or end, whichever suits the matcher, as long as no
+// match inside a line comes after a match in a later line.
+typedef int (*matcher_next_fn)(const void *impl, struct matcher_cursor *c, const char *end,
+                               struct match *m);
+
+struct matcher
+{
+  const void *impl;
+  int num_patterns;
+  matcher_reset_fn reset;
+  matcher_next_fn next;
+};
+
+#endif
@@ -0,0 +1,142 @@
+// Setting _DEFAULT_SOURCE is necessary to activate visibility of
+// certain header file contents on GNU/Linux systems.
+#define _DEFAULT_SOURCE
+
+#include "prefetch.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+// The most files claimed by a single prefetch_ahead() call.
+#define PREFETCH_MAX_CLAIM 64
+
+struct prefetch_claim
+{
+  struct prefetch *pf;
+  int seen; // Files looked at so far.
+  struct prefetch_hint *hints[PREFETCH_MAX_CLAIM];
+  int n;
+};
+
+void prefetch_init(struct prefetch *pf, int distance, long long budget, prefetch_hint_fn hint)
+{
+  pf->distance = distance;
+  pf->budget = budget;
+  pf->in_flight = 0;
+  pf->hint = hint;
+}
+
+void prefetch_hint_init(struct prefetch_hint *h, const char *path, off_t offset, off_t size)
+{
+  h->path = path;
+  h->offset = offset;
+  h->size = size;
+  h->fd = -1;
+  h->state = PREFETCH_NONE;
+  h->charged = 0;
+}
+
+// Runs with the queue locked, so the jobs cannot be popped and freed
+// under our feet.  We only claim files here; the system calls happen
+// after the lock has been released.
+static int prefetch_claim_job(void *job, void *arg)
+{
+  struct prefetch_claim *c = arg;
+  struct prefetch *pf = c->pf;
+  struct prefetch_hint *h;
+
+  for (int i = 0; (h = pf->hint(job, i)) != NULL; i++)
+  {
+    if (c->seen++ == pf->distance || c->n == PREFETCH_MAX_CLAIM)
+    {
+      return 1;
+    }
+
+    if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) != PREFETCH_NONE)
+    {
+      continue;
+    }
+
+    long long in_flight = __atomic_add_fetch(&pf->in_flight, h->size, __ATOMIC_RELAXED);
+    if (in_flight > pf->budget)
+    {
+      __atomic_sub_fetch(&pf->in_flight, h->size, __ATOMIC_RELAXED);
+      return 1;
+    }
+
+    int expected = PREFETCH_NONE;
+    if (__atomic_compare_exchange_n(&h->state, &expected, PREFETCH_BUSY, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+    {
+      h->charged = 1;
+      c->hints[c->n++] = h;
+    }
+    else
+    {
+      __atomic_sub_fetch(&pf->in_flight, h->size, __ATOMIC_RELAXED);
+    }
+  }
+
+  return 0;
+}
+
+void prefetch_ahead(struct prefetch *pf, struct job_queue *jq)
+{
+  if (pf->distance <= 0)
+  {
+    return;
+  }
+
+  struct prefetch_claim c;
+  c.pf = pf;
+  c.seen = 0;
+  c.n = 0;
+  job_queue_peek(jq, pf->distance, prefetch_claim_job, &c);
+
+  for (int i = 0; i < c.n; i++)
+  {
+    struct prefetch_hint *h = c.hints[i];
+
+    // WILLNEED starts asynchronous readahead of the part of the file
+    // we want and returns straight away.
+    h->fd = open(h->path, O_RDONLY | O_CLOEXEC);
+    if (h->fd >= 0)
+    {
+      posix_fadvise(h->fd, h->offset, h->size, POSIX_FADV_WILLNEED);
+    }
+
+    __atomic_store_n(&h->state, PREFETCH_DONE, __ATOMIC_RELEASE);
+  }
+}
+
+int prefetch_take(struct prefetch *pf, struct prefetch_hint *h)
+{
+  (void)pf;
+
+  int expected = PREFETCH_NONE;
+  if (__atomic_compare_exchange_n(&h->state, &expected, PREFETCH_TAKEN, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE))
+  {
+    return -1;
+  }
+
+  // Somebody is prefetching it right now.  That is just an open() and
+  // an fadvise(), so it will not take long.
+  while (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == PREFETCH_BUSY)
+  {
+    sched_yield();
+  }
+
+  h->state = PREFETCH_TAKEN;
+  return h->fd;
+}
+
+void prefetch_done(struct prefetch *pf, struct prefetch_hint *h)
+{
+  if (h->charged)
+  {
+    __atomic_sub_fetch(&pf->in_flight, h->size, __ATOMIC_RELAXED);
+    h->charged = 0;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <sys/types.h>
+
+#include "job_queue.h"
+
+// Warms the page cache for files that are still waiting in the job
+// queue, so that their data is (hopefully) in memory by the time a
+// worker gets to them.  Each worker calls prefetch_ahead() after it
+// has popped a job; this looks at the next 'distance' files waiting in
+// the queue (a job may hold several), and opens and
+// posix_fadvise(WILLNEED)s those that nobody has touched yet.  The
+// descriptor is kept in the hint so the worker that reads the file
+// later does not have to open it again.
+//
+// At most 'budget' bytes are prefetched but not yet read at any time,
+// so we never ask the kernel to cache more than it can comfortably
+// keep around until we need it.
+
+enum prefetch_state
+{
+  PREFETCH_NONE,  // Nobody has touched the file.
+  PREFETCH_BUSY,  // Being prefetched right now.
+  PREFETCH_DONE,  // Prefetched; 'fd' is open (or -1 if open failed).
+  PREFETCH_TAKEN, // A worker is reading it.
+};
+
+struct prefetch_hint
+{
+  const char *path;
+  off_t offset; // The part of the file that will be read.
+  off_t size;
+  int fd;
+  int state;
+  int charged; // Counted against the budget.
+};
+
+// Return the i'th file of a job, or NULL if it has no more files.
+typedef struct prefetch_hint *(*prefetch_hint_fn)(void *job, int i);
+
+struct prefetch
+{
+  int distance;
+  long long budget;
+  long long in_flight;
+  prefetch_hint_fn hint;
+};
+
+void prefetch_init(struct prefetch *pf, int distance, long long budget, prefetch_hint_fn hint);
+
+// Set up the hint for a file before it is pushed onto the queue.
+void prefetch_hint_init(struct prefetch_hint *h, const char *path, off_t offset, off_t size);
+
+// Prefetch some of the files that are next in line in the queue.
+void prefetch_ahead(struct prefetch *pf, struct job_queue *jq);
+
+// Claim a file for reading.  Returns an already open descriptor if the
+// file was prefetched, or -1 if the caller must open it itself.
+int prefetch_take(struct prefetch *pf, struct prefetch_hint *h);
+
+// Tell the prefetcher that the file has been read, so its bytes no
+// longer count against the budget.
+void prefetch_done(struct prefetch *pf, struct prefetch_hint *h);
+
+#endif
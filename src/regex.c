@@ -0,0 +1,1121 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as memrchr()) on GNU/Linux systems.
+#define _GNU_SOURCE
+
+#include "regex.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_io.h"
+
+// The most NFA states a regex may compile to.  Bounded repeats are
+// compiled by copying, so something like (a{1000}){1000} would
+// otherwise take all of memory.
+#define NFA_MAX_STATES (1 << 20)
+
+// The most NFA states, summed over all DFA states, that a DFA keeps
+// before it starts over.
+#define DFA_MAX_SET_SPACE (1 << 20)
+
+//
+// Parsing
+//
+
+enum re_type
+{
+  RE_EMPTY,
+  RE_CHAR,   // A byte in class 'cls'.
+  RE_CAT,    // 'left' then 'right'.
+  RE_ALT,    // 'left' or 'right'.
+  RE_REPEAT, // 'left' at least 'min' and at most 'max' (-1: any) times.
+  RE_BOL,
+  RE_EOL,
+};
+
+struct re_node
+{
+  int type;
+  int left;
+  int right;
+  int min;
+  int max;
+  int cls;
+};
+
+struct parser
+{
+  const char *pattern;
+  const char *p;
+  struct re_node *nodes;
+  int num_nodes;
+  int cap;
+  struct regex *re;
+  int nocase;
+
+  // Where a syntax error takes us, and why.
+  jmp_buf fail;
+  const char *error;
+};
+
+static void *re_realloc(void *p, size_t size)
+{
+  if ((p = realloc(p, size)) == NULL)
+  {
+    err(1, "realloc() failed");
+  }
+  return p;
+}
+
+static void parse_error(struct parser *ps, const char *msg)
+{
+  ps->error = msg;
+  longjmp(ps->fail, 1);
+}
+
+static int new_node(struct parser *ps, int type, int left, int right)
+{
+  if (ps->num_nodes == ps->cap)
+  {
+    ps->cap = ps->cap == 0 ? 64 : ps->cap * 2;
+    ps->nodes = re_realloc(ps->nodes, ps->cap * sizeof(struct re_node));
+  }
+
+  struct re_node *n = &ps->nodes[ps->num_nodes];
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  n->min = 0;
+  n->max = 0;
+  n->cls = -1;
+  return ps->num_nodes++;
+}
+
+static int new_class(struct regex *re)
+{
+  re->classes = re_realloc(re->classes, (re->num_classes + 1) * sizeof(*re->classes));
+  memset(re->classes[re->num_classes], 0, sizeof(*re->classes));
+  return re->num_classes++;
+}
+
+static void class_add(unsigned char *cls, int c)
+{
+  cls[c / 8] |= 1 << (c % 8);
+}
+
+static int class_has(const unsigned char *cls, int c)
+{
+  return (cls[c / 8] >> (c % 8)) & 1;
+}
+
+static void class_negate(unsigned char *cls)
+{
+  for (int i = 0; i < 32; i++)
+  {
+    cls[i] = ~cls[i];
+  }
+}
+
+// With -i, make every letter in the class match either case.  This
+// must happen before a class is negated.
+static void class_fold(struct parser *ps, unsigned char *cls)
+{
+  if (!ps->nocase)
+  {
+    return;
+  }
+  for (int c = 'a'; c <= 'z'; c++)
+  {
+    if (class_has(cls, c) || class_has(cls, c - 'a' + 'A'))
+    {
+      class_add(cls, c);
+      class_add(cls, c - 'a' + 'A');
+    }
+  }
+}
+
+static int char_node(struct parser *ps, int c)
+{
+  int n = new_node(ps, RE_CHAR, -1, -1);
+  ps->nodes[n].cls = new_class(ps->re);
+  class_add(ps->re->classes[ps->nodes[n].cls], c);
+  class_fold(ps, ps->re->classes[ps->nodes[n].cls]);
+  return n;
+}
+
+// Add the bytes of a \d-style escape to 'cls'.  Returns 0 if 'c' is
+// not one of those.
+static int class_escape(unsigned char *cls, int c)
+{
+  int (*fn)(int);
+  switch (tolower(c))
+  {
+  case 'd':
+    fn = isdigit;
+    break;
+  case 'w':
+    fn = isalnum;
+    break;
+  case 's':
+    fn = isspace;
+    break;
+  default:
+    return 0;
+  }
+
+  unsigned char tmp[32] = {0};
+  for (int i = 0; i < 256; i++)
+  {
+    if (fn(i) || (tolower(c) == 'w' && i == '_'))
+    {
+      class_add(tmp, i);
+    }
+  }
+  if (isupper(c))
+  {
+    class_negate(tmp);
+  }
+  for (int i = 0; i < 32; i++)
+  {
+    cls[i] |= tmp[i];
+  }
+  return 1;
+}
+
+static int plain_escape(int c)
+{
+  switch (c)
+  {
+  case 'n':
+    return '\n';
+  case 't':
+    return '\t';
+  default:
+    return c;
+  }
+}
+
+static const struct
+{
+  const char *name;
+  int (*fn)(int);
+} named_classes[] = {
+  {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+  {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+  {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+// Parse a bracket expression; 'ps->p' is just past the '['.
+static int parse_bracket(struct parser *ps)
+{
+  int n = new_node(ps, RE_CHAR, -1, -1);
+  int cls_index = new_class(ps->re);
+  ps->nodes[n].cls = cls_index;
+  unsigned char *cls = ps->re->classes[cls_index];
+
+  int negate = *ps->p == '^';
+  if (negate)
+  {
+    ps->p++;
+  }
+
+  int first = 1;
+  while (*ps->p != ']' || first)
+  {
+    if (*ps->p == '\0')
+    {
+      parse_error(ps, "missing ]");
+    }
+    first = 0;
+
+    if (ps->p[0] == '[' && ps->p[1] == ':')
+    {
+      const char *end = strstr(ps->p + 2, ":]");
+      size_t len = end == NULL ? 0 : (size_t)(end - (ps->p + 2));
+      size_t i;
+      for (i = 0; i < sizeof(named_classes) / sizeof(named_classes[0]); i++)
+      {
+        if (strlen(named_classes[i].name) == len &&
+            strncmp(named_classes[i].name, ps->p + 2, len) == 0)
+        {
+          break;
+        }
+      }
+      if (i == sizeof(named_classes) / sizeof(named_classes[0]))
+      {
+        parse_error(ps, "unknown character class");
+      }
+      for (int c = 0; c < 256; c++)
+      {
+        if (named_classes[i].fn(c))
+        {
+          class_add(cls, c);
+        }
+      }
+      ps->p = end + 2;
+      continue;
+    }
+
+    unsigned char lo = *ps->p++;
+    if (lo == '\\' && *ps->p != '\0')
+    {
+      if (class_escape(cls, *ps->p))
+      {
+        ps->p++;
+        continue;
+      }
+      lo = plain_escape(*ps->p++);
+    }
+
+    unsigned char hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0')
+    {
+      hi = ps->p[1];
+      ps->p += 2;
+      if (hi == '\\' && *ps->p != '\0')
+      {
+        hi = plain_escape(*ps->p++);
+      }
+      if (hi < lo)
+      {
+        parse_error(ps, "invalid range");
+      }
+    }
+
+    for (int c = lo; c <= hi; c++)
+    {
+      class_add(cls, c);
+    }
+  }
+  ps->p++;
+
+  class_fold(ps, cls);
+  if (negate)
+  {
+    class_negate(cls);
+  }
+  // Lines never contain a newline, but keep it out of the way anyway.
+  cls[(int)'\n' / 8] &= ~(1 << ('\n' % 8));
+
+  return n;
+}
+
+static int parse_alt(struct parser *ps);
+
+static int parse_atom(struct parser *ps)
+{
+  int c = (unsigned char)*ps->p++;
+  int n;
+
+  switch (c)
+  {
+  case '(':
+    n = parse_alt(ps);
+    if (*ps->p != ')')
+    {
+      parse_error(ps, "missing )");
+    }
+    ps->p++;
+    return n;
+  case '[':
+    return parse_bracket(ps);
+  case '.':
+    n = new_node(ps, RE_CHAR, -1, -1);
+    ps->nodes[n].cls = new_class(ps->re);
+    class_add(ps->re->classes[ps->nodes[n].cls], '\n');
+    class_negate(ps->re->classes[ps->nodes[n].cls]);
+    return n;
+  case '^':
+    return new_node(ps, RE_BOL, -1, -1);
+  case '$':
+    return new_node(ps, RE_EOL, -1, -1);
+  case '\\':
+    if (*ps->p == '\0')
+    {
+      parse_error(ps, "trailing backslash");
+    }
+    c = (unsigned char)*ps->p++;
+    n = new_node(ps, RE_CHAR, -1, -1);
+    ps->nodes[n].cls = new_class(ps->re);
+    if (!class_escape(ps->re->classes[ps->nodes[n].cls], c))
+    {
+      class_add(ps->re->classes[ps->nodes[n].cls], plain_escape(c));
+      class_fold(ps, ps->re->classes[ps->nodes[n].cls]);
+    }
+    return n;
+  case '*':
+  case '+':
+  case '?':
+    parse_error(ps, "repetition of nothing");
+    return -1;
+  default:
+    return char_node(ps, c);
+  }
+}
+
+// Parse "{m}", "{m,}" or "{m,n}".  Returns 0, and leaves 'ps->p' alone,
+// if it is not one of those, in which case the '{' is a literal.
+static int parse_bounds(struct parser *ps, int *min, int *max)
+{
+  const char *p = ps->p + 1;
+  char *end;
+
+  if (!isdigit((unsigned char)*p))
+  {
+    return 0;
+  }
+  *min = strtol(p, &end, 10);
+  *max = *min;
+  p = end;
+
+  if (*p == ',')
+  {
+    p++;
+    *max = -1;
+    if (isdigit((unsigned char)*p))
+    {
+      *max = strtol(p, &end, 10);
+      p = end;
+    }
+  }
+
+  if (*p != '}')
+  {
+    return 0;
+  }
+  if (*min > 1000 || *max > 1000 || (*max >= 0 && *max < *min))
+  {
+    parse_error(ps, "invalid repetition count");
+  }
+
+  ps->p = p + 1;
+  return 1;
+}
+
+static int parse_repeat(struct parser *ps)
+{
+  int n = parse_atom(ps);
+
+  for (;;)
+  {
+    int min, max;
+    switch (*ps->p)
+    {
+    case '*':
+      min = 0;
+      max = -1;
+      ps->p++;
+      break;
+    case '+':
+      min = 1;
+      max = -1;
+      ps->p++;
+      break;
+    case '?':
+      min = 0;
+      max = 1;
+      ps->p++;
+      break;
+    case '{':
+      if (!parse_bounds(ps, &min, &max))
+      {
+        return n;
+      }
+      break;
+    default:
+      return n;
+    }
+
+    int r = new_node(ps, RE_REPEAT, n, -1);
+    ps->nodes[r].min = min;
+    ps->nodes[r].max = max;
+    n = r;
+  }
+}
+
+static int parse_cat(struct parser *ps)
+{
+  int n = -1;
+
+  while (*ps->p != '\0' && *ps->p != '|' && *ps->p != ')')
+  {
+    int m = parse_repeat(ps);
+    n = n < 0 ? m : new_node(ps, RE_CAT, n, m);
+  }
+
+  return n < 0 ? new_node(ps, RE_EMPTY, -1, -1) : n;
+}
+
+static int parse_alt(struct parser *ps)
+{
+  int n = parse_cat(ps);
+
+  while (*ps->p == '|')
+  {
+    ps->p++;
+    n = new_node(ps, RE_ALT, n, parse_cat(ps));
+  }
+
+  return n;
+}
+
+//
+// Required literals
+//
+
+// The byte a node matches, if it is a single one, or -1.  With -i, a
+// letter in either case counts as a single byte too, as the literal is
+// searched for without case.
+static int single_byte(struct parser *ps, int n)
+{
+  if (ps->nodes[n].type != RE_CHAR)
+  {
+    return -1;
+  }
+
+  const unsigned char *cls = ps->re->classes[ps->nodes[n].cls];
+  int c = -1;
+  for (int i = 0; i < 256; i++)
+  {
+    if (class_has(cls, i))
+    {
+      int b = ps->nocase ? fold_byte(i) : i;
+      if (c >= 0 && b != c)
+      {
+        return -1;
+      }
+      c = b;
+    }
+  }
+  return c;
+}
+
+static void keep_longest(struct io_buffer *best, const struct io_buffer *run)
+{
+  if (run->len > best->len)
+  {
+    best->len = 0;
+    io_buffer_append(best, run->data, run->len);
+  }
+}
+
+// Find the longest literal that every match of node 'n' contains.
+static void required_literal(struct parser *ps, int n, struct io_buffer *best)
+{
+  struct re_node *node = &ps->nodes[n];
+
+  if (node->type == RE_REPEAT)
+  {
+    if (node->min > 0)
+    {
+      required_literal(ps, node->left, best);
+    }
+    return;
+  }
+  if (node->type != RE_CAT && node->type != RE_CHAR)
+  {
+    return;
+  }
+
+  // Walk the concatenation from left to right, and collect runs of
+  // single bytes.  Other parts may have required literals of their own.
+  int stack[256];
+  int depth = 0;
+  struct io_buffer run = {0};
+
+  stack[depth++] = n;
+  while (depth > 0)
+  {
+    int m = stack[--depth];
+    if (ps->nodes[m].type == RE_CAT && depth + 2 <= 256)
+    {
+      stack[depth++] = ps->nodes[m].right;
+      stack[depth++] = ps->nodes[m].left;
+      continue;
+    }
+
+    int c = single_byte(ps, m);
+    if (c >= 0)
+    {
+      char ch = c;
+      io_buffer_append(&run, &ch, 1);
+      continue;
+    }
+
+    keep_longest(best, &run);
+    run.len = 0;
+    if (ps->nodes[m].type == RE_REPEAT)
+    {
+      required_literal(ps, m, best);
+    }
+  }
+
+  keep_longest(best, &run);
+  io_buffer_free(&run);
+}
+
+//
+// NFA construction
+//
+
+static int new_state(struct parser *ps, int type, int out, int out1, int cls)
+{
+  struct regex *re = ps->re;
+  if (re->num_states == NFA_MAX_STATES)
+  {
+    parse_error(ps, "too big");
+  }
+  if (re->num_states == re->states_cap)
+  {
+    re->states_cap = re->states_cap == 0 ? 64 : re->states_cap * 2;
+    re->states = re_realloc(re->states, re->states_cap * sizeof(struct nfa_state));
+  }
+
+  struct nfa_state *s = &re->states[re->num_states];
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  s->cls = cls;
+  return re->num_states++;
+}
+
+// Compile node 'n' so that it continues to state 'out' when it has
+// matched, and return its first state.  We work backwards, so there is
+// never anything to patch up later, except for loops.
+static int compile(struct parser *ps, struct regex *re, int n, int out)
+{
+  struct re_node node = ps->nodes[n];
+
+  switch (node.type)
+  {
+  case RE_EMPTY:
+    return out;
+  case RE_CHAR:
+    return new_state(ps, NFA_CHAR, out, -1, node.cls);
+  case RE_CAT:
+    return compile(ps, re, node.left, compile(ps, re, node.right, out));
+  case RE_ALT:
+  {
+    int left = compile(ps, re, node.left, out);
+    int right = compile(ps, re, node.right, out);
+    return new_state(ps, NFA_SPLIT, left, right, -1);
+  }
+  case RE_BOL:
+    return new_state(ps, NFA_BOL, out, -1, -1);
+  case RE_EOL:
+    return new_state(ps, NFA_EOL, out, -1, -1);
+  case RE_REPEAT:
+  {
+    int cur = out;
+    if (node.max < 0)
+    {
+      // A loop: try another round, or leave.
+      int loop = new_state(ps, NFA_SPLIT, -1, out, -1);
+      re->states[loop].out = compile(ps, re, node.left, loop);
+      cur = loop;
+    }
+    else
+    {
+      for (int i = node.min; i < node.max; i++)
+      {
+        cur = new_state(ps, NFA_SPLIT, compile(ps, re, node.left, cur), out, -1);
+      }
+    }
+    for (int i = 0; i < node.min; i++)
+    {
+      cur = compile(ps, re, node.left, cur);
+    }
+    return cur;
+  }
+  }
+
+  return out;
+}
+
+// All the DFAs of a regex.
+struct dfa_list
+{
+  pthread_mutex_t lock;
+  struct dfa *head;
+};
+
+int regex_init(struct regex *re, const char *pattern, int nocase, const char **error)
+{
+  memset(re, 0, sizeof(*re));
+
+  // The parser lives on the heap, so that nothing in it is lost to
+  // longjmp().
+  struct parser *ps = calloc(1, sizeof(*ps));
+  if (ps == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+  ps->pattern = pattern;
+  ps->p = pattern;
+  ps->re = re;
+  ps->nocase = nocase;
+
+  if (setjmp(ps->fail) != 0)
+  {
+    *error = ps->error;
+    free(ps->nodes);
+    free(ps);
+    free(re->states);
+    free(re->classes);
+    return -1;
+  }
+
+  int root = parse_alt(ps);
+  if (*ps->p != '\0')
+  {
+    parse_error(ps, "unmatched )");
+  }
+
+  int match = new_state(ps, NFA_MATCH, -1, -1, -1);
+  re->start = compile(ps, re, root, match);
+
+  struct io_buffer best = {0};
+  required_literal(ps, root, &best);
+  if (best.len > 0)
+  {
+    if ((re->literal = malloc(best.len + 1)) == NULL)
+    {
+      err(1, "malloc() failed");
+    }
+    memcpy(re->literal, best.data, best.len);
+    re->literal[best.len] = '\0';
+    searcher_init(&re->literal_searcher, re->literal, best.len, nocase);
+  }
+  io_buffer_free(&best);
+  free(ps->nodes);
+  free(ps);
+
+  if (pthread_key_create(&re->dfa_key, NULL) != 0)
+  {
+    err(1, "pthread_key_create() failed");
+  }
+  if ((re->dfas = calloc(1, sizeof(struct dfa_list))) == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+  pthread_mutex_init(&re->dfas->lock, NULL);
+  return 0;
+}
+
+//
+// The lazy DFA
+//
+
+struct dfa
+{
+  const struct regex *re;
+
+  int num_states;
+  int *next; // DFA_MAX_STATES * 256 transitions; -1 if not known yet.
+  int *set_start;
+  int *set_len;
+  unsigned char *accept;     // The NFA has matched.
+  unsigned char *accept_eol; // It will have, if the line ends here.
+  int *hash_next;
+  int buckets[2 * DFA_MAX_STATES];
+
+  int *sets;
+  int sets_len;
+
+  // The state at the start of a line, or -1.
+  int start;
+
+  // How often we have run out of states and started over.
+  unsigned flushes;
+
+  // The next DFA of the same regex.
+  struct dfa *next_dfa;
+
+  // Scratch space for building sets.
+  int *work;
+  int *stack;
+  unsigned *mark;
+  unsigned generation;
+};
+
+static void dfa_flush(struct dfa *d)
+{
+  d->num_states = 0;
+  d->sets_len = 0;
+  d->start = -1;
+  for (int i = 0; i < 2 * DFA_MAX_STATES; i++)
+  {
+    d->buckets[i] = -1;
+  }
+}
+
+static struct dfa *dfa_new(const struct regex *re)
+{
+  struct dfa *d = calloc(1, sizeof(struct dfa));
+  if (d == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+
+  d->re = re;
+  d->next = re_realloc(NULL, DFA_MAX_STATES * 256 * sizeof(int));
+  d->set_start = re_realloc(NULL, DFA_MAX_STATES * sizeof(int));
+  d->set_len = re_realloc(NULL, DFA_MAX_STATES * sizeof(int));
+  d->accept = re_realloc(NULL, DFA_MAX_STATES);
+  d->accept_eol = re_realloc(NULL, DFA_MAX_STATES);
+  d->hash_next = re_realloc(NULL, DFA_MAX_STATES * sizeof(int));
+  d->sets = re_realloc(NULL, DFA_MAX_SET_SPACE * sizeof(int));
+  d->work = re_realloc(NULL, re->num_states * sizeof(int));
+  d->stack = re_realloc(NULL, re->num_states * sizeof(int));
+  d->mark = calloc(re->num_states, sizeof(unsigned));
+  if (d->mark == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+
+  dfa_flush(d);
+  return d;
+}
+
+static void dfa_free(void *arg)
+{
+  struct dfa *d = arg;
+
+  free(d->next);
+  free(d->set_start);
+  free(d->set_len);
+  free(d->accept);
+  free(d->accept_eol);
+  free(d->hash_next);
+  free(d->sets);
+  free(d->work);
+  free(d->stack);
+  free(d->mark);
+  free(d);
+}
+
+static struct dfa *regex_dfa(const struct regex *re)
+{
+  struct dfa *d = pthread_getspecific(re->dfa_key);
+  if (d == NULL)
+  {
+    d = dfa_new(re);
+    pthread_setspecific(re->dfa_key, d);
+
+    pthread_mutex_lock(&re->dfas->lock);
+    d->next_dfa = re->dfas->head;
+    re->dfas->head = d;
+    pthread_mutex_unlock(&re->dfas->lock);
+  }
+  return d;
+}
+
+static void new_generation(struct dfa *d)
+{
+  if (++d->generation == 0)
+  {
+    memset(d->mark, 0, d->re->num_states * sizeof(unsigned));
+    d->generation = 1;
+  }
+}
+
+// Add state 's', and everything reachable from it without consuming a
+// byte, to the work set.  BOL assertions are followed only if 'bol' is
+// set, and EOL assertions only if 'eol' is.  Only the states that
+// matter to the DFA (bytes, EOL assertions and the match) are kept.
+static int closure(struct dfa *d, int s, int n, int bol, int eol)
+{
+  const struct nfa_state *states = d->re->states;
+  int depth = 0;
+
+  if (d->mark[s] == d->generation)
+  {
+    return n;
+  }
+  d->mark[s] = d->generation;
+  d->stack[depth++] = s;
+
+  while (depth > 0)
+  {
+    const struct nfa_state *st = &states[d->stack[--depth]];
+    int next[2] = {-1, -1};
+
+    switch (st->type)
+    {
+    case NFA_CHAR:
+    case NFA_MATCH:
+      d->work[n++] = st - states;
+      break;
+    case NFA_SPLIT:
+      next[0] = st->out;
+      next[1] = st->out1;
+      break;
+    case NFA_BOL:
+      if (bol)
+      {
+        next[0] = st->out;
+      }
+      break;
+    case NFA_EOL:
+      d->work[n++] = st - states;
+      if (eol)
+      {
+        next[0] = st->out;
+      }
+      break;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+      if (next[i] >= 0 && d->mark[next[i]] != d->generation)
+      {
+        d->mark[next[i]] = d->generation;
+        d->stack[depth++] = next[i];
+      }
+    }
+  }
+
+  return n;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static unsigned hash_set(const int *set, int n)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0; i < n; i++)
+  {
+    h = (h ^ (unsigned)set[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Whether the NFA reaches the match from 'set' if the line ends here.
+static int set_accepts_eol(struct dfa *d, const int *set, int n)
+{
+  new_generation(d);
+
+  int m = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (d->re->states[set[i]].type == NFA_EOL)
+    {
+      m = closure(d, d->re->states[set[i]].out, m, 0, 1);
+    }
+  }
+
+  for (int i = 0; i < m; i++)
+  {
+    if (d->re->states[d->work[i]].type == NFA_MATCH)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Find or add the DFA state for the first 'n' states of the work set.
+static int dfa_state(struct dfa *d, int n)
+{
+  int *set = d->work;
+  qsort(set, n, sizeof(int), compare_int);
+
+  unsigned h = hash_set(set, n) % (2 * DFA_MAX_STATES);
+  for (int s = d->buckets[h]; s >= 0; s = d->hash_next[s])
+  {
+    if (d->set_len[s] == n && memcmp(d->sets + d->set_start[s], set, n * sizeof(int)) == 0)
+    {
+      return s;
+    }
+  }
+
+  // Out of room: start over.  Whoever asked for this state must not
+  // hold on to any other.
+  if (d->num_states == DFA_MAX_STATES || d->sets_len + n > DFA_MAX_SET_SPACE)
+  {
+    dfa_flush(d);
+    d->flushes++;
+  }
+
+  int s = d->num_states++;
+  d->set_start[s] = d->sets_len;
+  d->set_len[s] = n;
+  memcpy(d->sets + d->sets_len, set, n * sizeof(int));
+  d->sets_len += n;
+
+  d->accept[s] = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (d->re->states[set[i]].type == NFA_MATCH)
+    {
+      d->accept[s] = 1;
+    }
+  }
+  // This reuses the work set, so do it last.
+  d->accept_eol[s] = d->accept[s] || set_accepts_eol(d, d->sets + d->set_start[s], n);
+
+  for (int c = 0; c < 256; c++)
+  {
+    d->next[s * 256 + c] = -1;
+  }
+  d->hash_next[s] = d->buckets[h];
+  d->buckets[h] = s;
+
+  return s;
+}
+
+static int dfa_start(struct dfa *d)
+{
+  if (d->start < 0)
+  {
+    new_generation(d);
+    int n = closure(d, d->re->start, 0, 1, 0);
+    d->start = dfa_state(d, n);
+  }
+  return d->start;
+}
+
+// Work out where state 's' goes on byte 'c'.  As we are looking for a
+// match anywhere in the line, a new one may start after every byte.
+static int dfa_step(struct dfa *d, int s, unsigned char c)
+{
+  const struct regex *re = d->re;
+  int n = 0;
+
+  new_generation(d);
+  for (int i = 0; i < d->set_len[s]; i++)
+  {
+    const struct nfa_state *st = &re->states[d->sets[d->set_start[s] + i]];
+    if (st->type == NFA_CHAR && class_has(re->classes[st->cls], c))
+    {
+      n = closure(d, st->out, n, 0, 0);
+    }
+  }
+  n = closure(d, re->start, n, 0, 0);
+
+  unsigned flushes = d->flushes;
+  int t = dfa_state(d, n);
+
+  // If the cache was flushed, 's' is gone, and so is its row.
+  if (d->flushes == flushes)
+  {
+    d->next[s * 256 + c] = t;
+  }
+  return t;
+}
+
+// Return the end of the first match in [p, end), which is a whole line
+// without its newline, or NULL if there is none.
+static const char *dfa_match(struct dfa *d, const char *p, const char *end)
+{
+  int s = dfa_start(d);
+
+  for (;;)
+  {
+    if (d->accept[s])
+    {
+      return p;
+    }
+    if (p == end)
+    {
+      return d->accept_eol[s] ? p : NULL;
+    }
+
+    int t = d->next[s * 256 + (unsigned char)*p];
+    s = t >= 0 ? t : dfa_step(d, s, *p);
+    p++;
+  }
+}
+
+//
+// The matcher
+//
+
+static void regex_reset(const void *impl, struct matcher_cursor *c, const char *pos)
+{
+  (void)impl;
+  c->pos = pos;
+}
+
+static int regex_next(const void *impl, struct matcher_cursor *c, const char *end,
+                      struct match *m)
+{
+  const struct regex *re = impl;
+  struct dfa *d = regex_dfa(re);
+
+  while (c->pos < end)
+  {
+    const char *line = c->pos;
+    const char *hit = NULL;
+
+    if (re->literal != NULL)
+    {
+      hit = searcher_find(&re->literal_searcher, c->pos, end - c->pos);
+      if (hit == NULL)
+      {
+        c->pos = end;
+        return 0;
+      }
+      line = memrchr(c->pos, '\n', hit - c->pos);
+      line = line == NULL ? c->pos : line + 1;
+    }
+
+    const char *nl = memchr(line, '\n', end - line);
+    const char *line_end = nl == NULL ? end : nl;
+    const char *visible_end = line + strnlen(line, line_end - line);
+    c->pos = nl == NULL ? end : nl + 1;
+
+    // strstr() on a line from getline() would not see past a NUL, and
+    // nor do we.
+    if (hit != NULL && hit >= visible_end)
+    {
+      continue;
+    }
+
+    const char *match_end = dfa_match(d, line, visible_end);
+    if (match_end != NULL)
+    {
+      m->start = line;
+      m->end = match_end;
+      m->id = 0;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void regex_matcher(const struct regex *re, struct matcher *m)
+{
+  m->impl = re;
+  m->num_patterns = 1;
+  m->reset = regex_reset;
+  m->next = regex_next;
+}
+
+void regex_destroy(struct regex *re)
+{
+  // The threads may well outlive the regex, as the workers of a
+  // server do, so their DFAs are freed here rather than as they exit.
+  while (re->dfas->head != NULL)
+  {
+    struct dfa *d = re->dfas->head;
+    re->dfas->head = d->next_dfa;
+    dfa_free(d);
+  }
+  pthread_mutex_destroy(&re->dfas->lock);
+  free(re->dfas);
+  pthread_key_delete(re->dfa_key);
+
+  free(re->states);
+  free(re->classes);
+  free(re->literal);
+}
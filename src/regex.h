@@ -0,0 +1,81 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "find.h"
+#include "matcher.h"
+
+// Extended regular expressions, matched one line at a time by a DFA
+// that is built lazily, as the data needs it.
+//
+// The regex is parsed and compiled to an NFA once, in the main thread,
+// and is shared read-only from then on.  Each thread that uses it
+// grows its own DFA from the NFA, a state at a time, and keeps at most
+// DFA_MAX_STATES of them; when it runs out, it throws them all away and
+// starts over.
+//
+// If every match must contain some literal string, we look for that
+// with a searcher first, and only run the DFA on the lines that have
+// it.
+//
+// The syntax is that of POSIX EREs, working on bytes: . [] [^] with
+// ranges and [:classes:], ^ $ ( ) | * + ? {m} {m,} {m,n}, and the
+// escapes \d \D \w \W \s \S \n \t.  '.' and negated classes never match
+// a newline.
+
+#define DFA_MAX_STATES 1024
+
+struct dfa_list;
+
+enum nfa_type
+{
+  NFA_CHAR,  // Match a byte in class 'cls' and go to 'out'.
+  NFA_SPLIT, // Go to both 'out' and 'out1'.
+  NFA_BOL,   // Go to 'out' at the start of a line.
+  NFA_EOL,   // Go to 'out' at the end of a line.
+  NFA_MATCH,
+};
+
+struct nfa_state
+{
+  int type;
+  int out;
+  int out1;
+  int cls;
+};
+
+struct regex
+{
+  int num_states;
+  int states_cap;
+  struct nfa_state *states;
+  int start;
+
+  int num_classes;
+  unsigned char (*classes)[32]; // Bitmaps of the bytes in each class.
+
+  // The longest string every match contains, if any.
+  char *literal;
+  struct searcher literal_searcher;
+
+  // Each thread's DFA, and a list of them all, so that they can be
+  // freed while the threads carry on.
+  pthread_key_t dfa_key;
+  struct dfa_list *dfas;
+};
+
+// Compile 'pattern'.  With 'nocase', ASCII letters match either case.
+// Returns 0, or -1 with '*error' set to what is wrong if the pattern is
+// not valid, in which case there is nothing to destroy.
+int regex_init(struct regex *re, const char *pattern, int nocase, const char **error);
+
+// Free the regex, and the DFAs of every thread.  No thread may be
+// matching with it any more.
+void regex_destroy(struct regex *re);
+
+// Set up 'm' to find the lines that match.
+void regex_matcher(const struct regex *re, struct matcher *m);
+
+#endif
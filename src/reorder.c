@@ -0,0 +1,90 @@
+#include "reorder.h"
+
+#include <err.h>
+#include <stdlib.h>
+
+void reorder_init(struct reorder *r, reorder_write_fn write, void *arg, long window)
+{
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->room, NULL);
+  r->write = write;
+  r->arg = arg;
+  r->window = window;
+  r->next = 0;
+  r->slots = calloc(window, sizeof(struct reorder_slot));
+  if (r->slots == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+}
+
+void reorder_destroy(struct reorder *r)
+{
+  for (long i = 0; i < r->window; i++)
+  {
+    io_buffer_free(&r->slots[i].out);
+  }
+  free(r->slots);
+  pthread_cond_destroy(&r->room);
+  pthread_mutex_destroy(&r->lock);
+}
+
+int reorder_fits(struct reorder *r, long seq)
+{
+  return seq < __atomic_load_n(&r->next, __ATOMIC_RELAXED) + r->window;
+}
+
+void reorder_wait(struct reorder *r, long seq)
+{
+  pthread_mutex_lock(&r->lock);
+  while (seq >= r->next + r->window)
+  {
+    pthread_cond_wait(&r->room, &r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+void reorder_write(struct reorder *r, long seq, const char *data, size_t len)
+{
+  pthread_mutex_lock(&r->lock);
+  if (seq == r->next)
+  {
+    r->write(r->arg, data, len);
+  }
+  else
+  {
+    io_buffer_append(&r->slots[seq % r->window].out, data, len);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+void reorder_done(struct reorder *r, long seq)
+{
+  pthread_mutex_lock(&r->lock);
+
+  r->slots[seq % r->window].done = 1;
+  if (seq == r->next)
+  {
+    // Its own output is already out.  Every finished file after it
+    // comes next, and the first unfinished one can start writing
+    // directly.
+    long next = seq;
+    do
+    {
+      r->slots[next % r->window].done = 0;
+      next++;
+
+      struct reorder_slot *slot = &r->slots[next % r->window];
+      if (slot->out.len > 0)
+      {
+        r->write(r->arg, slot->out.data, slot->out.len);
+        slot->out.len = 0;
+      }
+    } while (r->slots[next % r->window].done);
+
+    __atomic_store_n(&r->next, next, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&r->room);
+  }
+
+  pthread_mutex_unlock(&r->lock);
+}
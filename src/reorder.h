@@ -0,0 +1,58 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "file_io.h"
+
+// Writes the output of files in the order they were found, whatever
+// order they finish in.
+//
+// Files are numbered from 0 as they are found.  The oldest file that is
+// not finished yet writes its output straight away; any other file's
+// output is held in a slot until every file before it is done.  There
+// are only 'window' slots, so the producer must not hand out file
+// number 'seq' before reorder_wait() says it fits.  The workers never
+// wait on each other, so they can always finish the files they have,
+// and with them the oldest file.
+
+// Writes out 'len' bytes of output.
+typedef void (*reorder_write_fn)(void *arg, const char *data, size_t len);
+
+struct reorder_slot
+{
+  int done;
+  struct io_buffer out; // Kept from file to file.
+};
+
+struct reorder
+{
+  pthread_mutex_t lock;
+  pthread_cond_t room;
+  reorder_write_fn write;
+  void *arg;
+  long window;
+  long next; // The oldest file not finished yet.
+  struct reorder_slot *slots;
+};
+
+void reorder_init(struct reorder *r, reorder_write_fn write, void *arg, long window);
+
+void reorder_destroy(struct reorder *r);
+
+// Does file number 'seq' fit into the window right now?
+int reorder_fits(struct reorder *r, long seq);
+
+// Wait until file number 'seq' fits into the window.  The files before
+// it must already be on their way to the workers.
+void reorder_wait(struct reorder *r, long seq);
+
+// Output for file number 'seq', to follow whatever it had before.
+void reorder_write(struct reorder *r, long seq, const char *data, size_t len);
+
+// File number 'seq' has no more output.  Writes out the held output of
+// the files after it, up to the next one that is not finished.
+void reorder_done(struct reorder *r, long seq);
+
+#endif
@@ -0,0 +1,227 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as memrchr()) on GNU/Linux systems.
+#define _GNU_SOURCE
+
+#include "search.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "find.h"
+
+void search_init(struct search *s)
+{
+  memset(s, 0, sizeof(*s));
+}
+
+void search_destroy(struct search *s)
+{
+  io_buffer_free(&s->carry);
+  free(s->seen);
+}
+
+void search_start(struct search *s, const struct matcher *matcher, search_match_fn match,
+                  void *arg)
+{
+  s->matcher = matcher;
+  s->match = match;
+  s->arg = arg;
+  s->lineno = 1;
+  s->count = 0;
+  s->done = 0;
+  s->binary = 0;
+  s->first_block = 1;
+  s->carry.len = 0;
+
+  if (matcher->num_patterns > 1 && matcher->num_patterns > s->seen_cap)
+  {
+    free(s->seen);
+    if ((s->seen = calloc(matcher->num_patterns, sizeof(*s->seen))) == NULL)
+    {
+      err(1, "calloc() failed");
+    }
+    s->seen_cap = matcher->num_patterns;
+    s->line_stamp = 0;
+  }
+}
+
+// Search a buffer that starts at the beginning of a line, and that
+// either ends with a newline or is the end of the file.
+static void search_lines(struct search *s, const char *buf, size_t len)
+{
+  const struct matcher *m = s->matcher;
+  const char *end = buf + len;
+  const char *counted = buf;
+  const char *last_line = NULL;
+
+  // Binary files are only searched to see whether they match.
+  int count_only = s->count_only || s->binary;
+  int max_count = s->binary ? 1 : s->max_count;
+
+  // The line of the last match, and where it stops as far as strstr()
+  // on a line from getline() is concerned: at the first NUL.
+  const char *line = buf;
+  const char *line_end = buf;
+  const char *visible_end = buf;
+
+  struct matcher_cursor c;
+  struct match hit;
+  m->reset(m->impl, &c, buf);
+
+  while (m->next(m->impl, &c, end, &hit))
+  {
+    // An empty pattern matches at the very end too, but there is no
+    // line there.
+    if (hit.start >= end)
+    {
+      break;
+    }
+
+    // A pattern with a newline in it cannot match across lines, only
+    // at the very end of one.
+    if (hit.end - hit.start > 1 && memchr(hit.start, '\n', hit.end - hit.start - 1) != NULL)
+    {
+      continue;
+    }
+
+    if (hit.start >= line_end)
+    {
+      line = memrchr(line_end, '\n', hit.start - line_end);
+      line = line == NULL ? line_end : line + 1;
+      line_end = memchr(hit.start, '\n', end - hit.start);
+      line_end = line_end == NULL ? end : line_end + 1;
+      visible_end = line + strnlen(line, line_end - line);
+      s->line_stamp++;
+    }
+
+    // Any match that ends before the NUL has been seen already.
+    if (hit.end > visible_end)
+    {
+      m->reset(m->impl, &c, line_end);
+      continue;
+    }
+
+    // Any pattern will do to count the line.
+    if (count_only)
+    {
+      if (++s->count == max_count)
+      {
+        s->done = 1;
+        break;
+      }
+      m->reset(m->impl, &c, line_end);
+      continue;
+    }
+
+    if (m->num_patterns > 1)
+    {
+      if (s->seen[hit.id] == s->line_stamp)
+      {
+        continue;
+      }
+      s->seen[hit.id] = s->line_stamp;
+    }
+
+    // If this is the last line we want, report the rest of its
+    // patterns, and stop.
+    if (line != last_line)
+    {
+      last_line = line;
+      if (++s->count == max_count)
+      {
+        s->done = 1;
+        end = line_end;
+      }
+    }
+
+    s->lineno += count_newlines(counted, line - counted);
+    counted = line;
+
+    s->match(s->arg, s->lineno, hit.id, line, visible_end - line);
+
+    // With a single pattern there is nothing more to find on this line.
+    if (m->num_patterns == 1)
+    {
+      m->reset(m->impl, &c, line_end);
+    }
+  }
+
+  if (!count_only)
+  {
+    s->lineno += count_newlines(counted, end - counted);
+  }
+}
+
+int search_block(void *arg, const char *buf, size_t len)
+{
+  struct search *s = arg;
+  const char *end = buf + len;
+
+  if (s->done)
+  {
+    return 1;
+  }
+
+  if (s->first_block)
+  {
+    s->first_block = 0;
+    if (s->binary_files != SEARCH_BINARY_TEXT && memchr(buf, '\0', len) != NULL)
+    {
+      s->binary = 1;
+      if (s->binary_files == SEARCH_BINARY_SKIP)
+      {
+        s->done = 1;
+        return 1;
+      }
+    }
+  }
+
+  // Complete the line left over from the last block first.
+  if (s->carry.len > 0)
+  {
+    const char *nl = memchr(buf, '\n', len);
+    if (nl == NULL)
+    {
+      io_buffer_append(&s->carry, buf, len);
+      return 0;
+    }
+
+    io_buffer_append(&s->carry, buf, nl + 1 - buf);
+    search_lines(s, s->carry.data, s->carry.len);
+    s->carry.len = 0;
+    buf = nl + 1;
+    if (s->done)
+    {
+      return 1;
+    }
+  }
+
+  // Search all complete lines straight out of the block, and keep the
+  // partial one at the end for later.
+  const char *last = memrchr(buf, '\n', end - buf);
+  if (last != NULL)
+  {
+    search_lines(s, buf, last + 1 - buf);
+    buf = last + 1;
+    if (s->done)
+    {
+      return 1;
+    }
+  }
+  if (buf < end)
+  {
+    io_buffer_append(&s->carry, buf, end - buf);
+  }
+
+  return 0;
+}
+
+void search_finish(struct search *s)
+{
+  if (s->carry.len > 0 && !s->done)
+  {
+    search_lines(s, s->carry.data, s->carry.len);
+    s->carry.len = 0;
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+#include "file_io.h"
+#include "matcher.h"
+
+// Called for every line that contains a pattern, once for each pattern
+// 'id' that it contains.  'line' is the line as getline() followed by
+// printf("%s") would show it: it includes the trailing newline, if any,
+// and stops at the first NUL byte.
+typedef void (*search_match_fn)(void *arg, int lineno, int id, const char *line, size_t len);
+
+// What to do with a binary file, which we take to be one with a NUL
+// byte in its first block.
+enum search_binary
+{
+  SEARCH_BINARY_TEXT,    // Search it like any other file (grep -a).
+  SEARCH_BINARY_SKIP,    // Do not search it, as if nothing matched (grep -I).
+  SEARCH_BINARY_MATCHES, // Stop at the first matching line, without reporting it.
+};
+
+// Searches a file, which arrives in blocks, for lines containing the
+// patterns of a matcher.  Rather than splitting the file into lines, we
+// look for the patterns in the whole block at once, and only work out where the line
+// starts and ends, and which line it is, once we have a hit.  Line
+// numbers are kept up to date by counting newlines from one hit to the
+// next.
+struct search
+{
+  const struct matcher *matcher;
+  search_match_fn match;
+  void *arg;
+
+  // Number of the line that starts at the first byte not counted yet.
+  int lineno;
+
+  // If set, the matching lines are only counted, and not reported, and
+  // no line numbers are kept.  Set it after search_init().
+  int count_only;
+
+  // Stop after this many matching lines, or never if 0.  Set it after
+  // search_init().
+  int max_count;
+
+  // One of enum search_binary.  Set it before search_start().
+  int binary_files;
+
+  // Matching lines so far, and whether we have stopped.
+  int count;
+  int done;
+
+  // Whether the file is binary, once its first block has been seen.
+  int binary;
+  int first_block;
+
+  // A partial line at the end of the previous block.  Reused from one
+  // file to the next.
+  struct io_buffer carry;
+
+  // With several patterns, seen[id] == line_stamp if pattern 'id' has
+  // already been reported for the current line.
+  unsigned long long *seen;
+  int seen_cap;
+  unsigned long long line_stamp;
+};
+
+void search_init(struct search *s);
+
+void search_destroy(struct search *s);
+
+// Get ready to search a new file for the matcher's patterns.
+void search_start(struct search *s, const struct matcher *matcher, search_match_fn match,
+                  void *arg);
+
+// Search the next block of the file.  Has the signature of a
+// file_data_fn, with the search as its argument, and returns non-zero
+// once 'max_count' lines have matched.
+int search_block(void *arg, const char *buf, size_t len);
+
+// The whole file has been seen; handle a last line without a newline.
+void search_finish(struct search *s);
+
+#endif
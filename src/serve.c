@@ -0,0 +1,209 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as MSG_CMSG_CLOEXEC) on GNU/Linux
+// systems.
+#define _GNU_SOURCE
+
+#include "serve.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Descriptors passed with a message are limited to this many.
+#define SERVE_MAX_FDS 8
+
+static void socket_address(struct sockaddr_un *addr, const char *path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+  {
+    errx(1, "socket path too long: %s", path);
+  }
+  strcpy(addr->sun_path, path);
+}
+
+int serve_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  socket_address(&addr, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    err(1, "socket() failed");
+  }
+  // A socket file stays behind when a server is killed.
+  if (unlink(path) != 0 && errno != ENOENT)
+  {
+    err(1, "failed to remove %s", path);
+  }
+  // Searches run as us, so only we may ask for them.  Nobody can
+  // connect before listen(), so there is no window to worry about.
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(path, 0600) != 0 ||
+      listen(sock, 64) != 0)
+  {
+    err(1, "failed to listen on %s", path);
+  }
+  return sock;
+}
+
+int serve_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  socket_address(&addr, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    err(1, "socket() failed");
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    err(1, "failed to connect to %s", path);
+  }
+  return sock;
+}
+
+void serve_send(int sock, const char *data, size_t len, const int *fds, int num_fds)
+{
+  if (num_fds > SERVE_MAX_FDS)
+  {
+    errx(1, "too many descriptors to pass");
+  }
+
+  // The descriptors go with the length, and the rest follows.
+  uint64_t header = len;
+  struct iovec iov = {&header, sizeof(header)};
+  union
+  {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (num_fds > 0)
+  {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, num_fds * sizeof(int));
+  }
+
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+  {
+  }
+  if (n < 0)
+  {
+    err(1, "sendmsg() failed");
+  }
+  // Eight bytes on a fresh socket go in one piece.
+  if ((size_t)n != sizeof(header))
+  {
+    errx(1, "sendmsg() sent a partial header");
+  }
+
+  int error = file_write(sock, data, len);
+  if (error != 0)
+  {
+    errno = error;
+    err(1, "failed to send request");
+  }
+}
+
+// Read exactly 'len' bytes.
+static int read_all(int sock, char *data, size_t len)
+{
+  for (size_t done = 0; done < len;)
+  {
+    ssize_t n = read(sock, data + done, len - done);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int serve_recv(int sock, struct io_buffer *msg, int *fds, int num_fds)
+{
+  uint64_t header;
+  struct iovec iov = {&header, sizeof(header)};
+  union
+  {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+  } control;
+
+  struct msghdr m = {0};
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+  m.msg_control = control.buf;
+  m.msg_controllen = sizeof(control.buf);
+
+  ssize_t n;
+  while ((n = recvmsg(sock, &m, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+  {
+  }
+
+  // Take whatever descriptors came, so as not to leak them.
+  int received = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&m); n > 0 && c != NULL; c = CMSG_NXTHDR(&m, c))
+  {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+    {
+      continue;
+    }
+    int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count; i++)
+    {
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (received < num_fds)
+      {
+        fds[received] = fd;
+      }
+      else
+      {
+        close(fd);
+      }
+      received++;
+    }
+  }
+
+  int ok = n == sizeof(header) && !(m.msg_flags & MSG_CTRUNC) && received == num_fds &&
+           header <= SERVE_MAX_REQUEST;
+  if (ok)
+  {
+    msg->len = 0;
+    io_buffer_reserve(msg, header);
+    msg->len = header;
+    ok = read_all(sock, msg->data, header) == 0;
+  }
+  if (!ok)
+  {
+    for (int i = 0; i < received && i < num_fds; i++)
+    {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+
+#include "file_io.h"
+
+// Requests to a search server over a UNIX socket.
+//
+// A client connects, and sends a single message: a length, that many
+// bytes, and along with them a few of its own file descriptors, such as
+// its standard output.  The server writes what it has to say to those
+// itself, so nothing has to be copied through the client, and it
+// answers on the socket with just an exit status once it is done.
+
+// Larger requests are taken to be garbage.
+#define SERVE_MAX_REQUEST (64 * 1024 * 1024)
+
+// Listen on 'path', replacing whatever socket was left there before.
+// Only our own user may connect.  Exits with an error message on
+// failure.
+int serve_listen(const char *path);
+
+// Connect to the server listening on 'path'.  Exits with an error
+// message on failure.
+int serve_connect(const char *path);
+
+// Send 'len' bytes, and the 'num_fds' descriptors in 'fds'.  Exits
+// with an error message on failure.
+void serve_send(int sock, const char *data, size_t len, const int *fds, int num_fds);
+
+// Receive a message sent with serve_send() into 'msg', and exactly
+// 'num_fds' descriptors into 'fds'.  Returns 0, or -1 if the client
+// sent something else or went away, in which case no descriptors are
+// left open.
+int serve_recv(int sock, struct io_buffer *msg, int *fds, int num_fds);
+
+#endif
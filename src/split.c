@@ -0,0 +1,153 @@
+#include "split.h"
+
+#include <err.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct split_file *split_new(int num_parts, int window)
+{
+  struct split_file *f = calloc(1, sizeof(*f) + window * sizeof(struct split_part));
+  if (f == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->room, NULL);
+  f->num_parts = num_parts;
+  f->window = window;
+  return f;
+}
+
+struct split_file *split_file_new(int num_parts)
+{
+  return split_new(num_parts, num_parts);
+}
+
+struct split_file *split_stream_new(int window)
+{
+  return split_new(INT_MAX, window);
+}
+
+void split_file_free(struct split_file *f)
+{
+  for (int i = 0; i < f->window; i++)
+  {
+    io_buffer_free(&f->parts[i].out);
+  }
+  io_buffer_free(&f->out);
+  pthread_cond_destroy(&f->room);
+  pthread_mutex_destroy(&f->lock);
+  free(f);
+}
+
+void split_stream_wait(struct split_file *f, int part)
+{
+  pthread_mutex_lock(&f->lock);
+  while (part >= f->next + f->window)
+  {
+    pthread_cond_wait(&f->room, &f->lock);
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+void split_stream_end(struct split_file *f, int num_parts)
+{
+  pthread_mutex_lock(&f->lock);
+  f->num_parts = num_parts;
+  pthread_mutex_unlock(&f->lock);
+}
+
+int split_part_done(struct split_file *f, int part, split_emit_fn emit, void *arg)
+{
+  pthread_mutex_lock(&f->lock);
+
+  split_part(f, part)->done = 1;
+  int next = f->next;
+  while (f->next < f->num_parts && split_part(f, f->next)->done)
+  {
+    struct split_part *p = split_part(f, f->next);
+    if (f->next == 0)
+    {
+      f->binary = p->binary;
+    }
+    f->next++;
+    emit(arg, f, p);
+    f->lines += p->lines;
+    f->count += p->count;
+
+    // The place is free for a later part of a stream.
+    p->done = 0;
+    io_buffer_free(&p->out);
+  }
+  int last = f->next == f->num_parts;
+  if (f->next != next)
+  {
+    pthread_cond_signal(&f->room);
+  }
+
+  pthread_mutex_unlock(&f->lock);
+  return last;
+}
+
+off_t split_reader_start(struct split_reader *r, off_t start, off_t end, file_data_fn data,
+                         void *arg)
+{
+  r->start = start;
+  r->end = end;
+  r->started = start == 0;
+  r->data = data;
+  r->arg = arg;
+
+  // We need to see the byte before the part, to know whether a line
+  // starts right at 'start'.
+  r->pos = start == 0 ? 0 : (start - 1) / IO_ALIGN * IO_ALIGN;
+  return r->pos;
+}
+
+// The first newline at or after file offset 'from' in the block at
+// 'buf', which starts at file offset 'base'.
+static const char *find_newline(const char *buf, const char *end, off_t base, off_t from)
+{
+  const char *p = from > base ? buf + (from - base) : buf;
+  return p < end ? memchr(p, '\n', end - p) : NULL;
+}
+
+int split_block(void *arg, const char *buf, size_t len)
+{
+  struct split_reader *r = arg;
+  const char *p = buf;
+  const char *end = buf + len;
+  off_t base = r->pos;
+  r->pos += len;
+
+  // Our first line is the one after the first newline at or after
+  // 'start - 1'.  If that newline is at 'end - 1' or later, no line
+  // starts in the part at all.
+  if (!r->started)
+  {
+    const char *nl = find_newline(buf, end, base, r->start - 1);
+    if (nl == NULL)
+    {
+      return 0;
+    }
+    if (base + (nl - buf) >= r->end - 1)
+    {
+      return 1;
+    }
+    r->started = 1;
+    p = nl + 1;
+  }
+
+  // Likewise, the last line is the one that ends with the first
+  // newline at or after 'end - 1'.
+  const char *nl = find_newline(p, end, base + (p - buf), r->end - 1);
+  if (nl != NULL)
+  {
+    r->data(r->arg, p, nl + 1 - p);
+    return 1;
+  }
+
+  return r->data(r->arg, p, end - p);
+}
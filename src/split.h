@@ -0,0 +1,112 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+// A huge file is split into parts of a fixed number of bytes, which
+// different workers search at the same time.
+//
+// A part owns the lines that start within its byte range.  Its reader
+// starts a little before the range, skips to the first line that
+// starts in it, and carries on past its end to finish the last line.
+// So every line is searched once, whole, by exactly one part, and
+// needles never straddle two parts.
+//
+// A part's output is held back, with line numbers counted from the
+// start of the part, until every part before it has been printed.  By
+// then we know how many newlines those parts had, so we can fix the
+// line numbers up, and the file comes out exactly as if it had been
+// searched from start to end by one thread.
+//
+// A stream, such as standard input, is split the same way, except
+// that its parts are cut at line ends as it is read, and how many
+// there are is only known at its end.  Its parts go round a ring of
+// 'window' of them, so no more than that are in flight at a time.
+
+struct split_part
+{
+  int done;
+  int lines; // Newlines in the lines the part owns.
+  int count; // Matching lines, for -c.
+
+  // Only the first part sees the start of the file, so only it can
+  // tell whether the file is binary, for all of them.
+  int binary;
+
+  // Whatever the part wants printed, in its own format.
+  struct io_buffer out;
+};
+
+struct split_file
+{
+  pthread_mutex_t lock;
+  pthread_cond_t room; // For a stream, a part has been printed.
+  int num_parts;       // For a stream, INT_MAX until its end.
+  int window;          // Part i is parts[i % window].
+  int next;            // The first part not printed yet.
+  int lines;           // Newlines in the parts printed so far.
+  int count;           // Matching lines in the parts printed so far.
+  int binary;          // Is the file binary, as the first part tells?
+  int failed;          // Did reading any part fail?
+
+  // Whatever the emitter wants to keep for the file as a whole.
+  struct io_buffer out;
+
+  struct split_part parts[];
+};
+
+// Print a part.  The totals in 'f' are those of the parts before it,
+// so its first line is line number f->lines + 1 of the file.
+typedef void (*split_emit_fn)(void *arg, struct split_file *f, struct split_part *part);
+
+struct split_file *split_file_new(int num_parts);
+
+// A stream with at most 'window' parts in flight.
+struct split_file *split_stream_new(int window);
+
+void split_file_free(struct split_file *f);
+
+static inline struct split_part *split_part(struct split_file *f, int part)
+{
+  return &f->parts[part % f->window];
+}
+
+// Wait until part 'part' of a stream has a place in the ring.
+void split_stream_wait(struct split_file *f, int part);
+
+// Tell that a stream has 'num_parts' parts, before the last one is
+// handed out.
+void split_stream_end(struct split_file *f, int num_parts);
+
+// Mark a part as finished, and emit it and any finished parts after
+// it, if all the parts before it have been emitted.  Returns non-zero
+// if this emitted the last part of the file.
+int split_part_done(struct split_file *f, int part, split_emit_fn emit, void *arg);
+
+// Trims the blocks of a file to the lines that a part owns, and passes
+// them on to another file_data_fn.
+struct split_reader
+{
+  off_t pos;   // File offset of the next block.
+  off_t start; // The part's byte range.
+  off_t end;
+  int started; // Have we reached the first line of the part?
+
+  file_data_fn data;
+  void *arg;
+};
+
+// Get ready to read the part [start, end).  Returns the offset to read
+// from, which is IO_ALIGN aligned if 'start' is.
+off_t split_reader_start(struct split_reader *r, off_t start, off_t end, file_data_fn data,
+                         void *arg);
+
+// A file_data_fn, with the reader as its argument.  Stops reading once
+// the part's last line is complete.
+int split_block(void *arg, const char *buf, size_t len);
+
+#endif
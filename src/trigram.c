@@ -0,0 +1,591 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as asprintf()) on GNU/Linux
+// systems.
+#define _GNU_SOURCE
+
+#include "trigram.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "find.h"
+
+// A file as collected by the builder.
+struct trigram_built
+{
+  long id;
+  char *path;
+  struct file_id file;
+  uint32_t *trigrams;
+  size_t num_trigrams;
+};
+
+void trigram_set_init(struct trigram_set *t)
+{
+  memset(t, 0, sizeof(*t));
+  if ((t->seen = calloc(TRIGRAM_SPACE / 8, 1)) == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+}
+
+void trigram_set_destroy(struct trigram_set *t)
+{
+  free(t->seen);
+  free(t->list);
+}
+
+void trigram_set_add(struct trigram_set *t, const char *buf, size_t len)
+{
+  uint32_t last = t->last;
+  size_t bytes = t->bytes;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    // fold_byte(), by hand, as this is all we do with every byte.
+    unsigned char c = buf[i];
+    if ((unsigned)(c - 'A') < 26)
+    {
+      c |= 0x20;
+    }
+    last = ((last << 8) | c) & (TRIGRAM_SPACE - 1);
+    if (++bytes < 3 || t->seen[last >> 3] & (1 << (last & 7)))
+    {
+      continue;
+    }
+
+    t->seen[last >> 3] |= 1 << (last & 7);
+    if (t->len == t->cap)
+    {
+      t->cap = t->cap == 0 ? 1024 : t->cap * 2;
+      if ((t->list = realloc(t->list, t->cap * sizeof(uint32_t))) == NULL)
+      {
+        err(1, "realloc() failed");
+      }
+    }
+    t->list[t->len++] = last;
+  }
+
+  t->last = last;
+  t->bytes = bytes;
+}
+
+void trigram_set_clear(struct trigram_set *t)
+{
+  // Only clear the bits we set, rather than all 2 MB of them.
+  for (size_t i = 0; i < t->len; i++)
+  {
+    t->seen[t->list[i] >> 3] = 0;
+  }
+  t->len = 0;
+  t->last = 0;
+  t->bytes = 0;
+}
+
+void trigram_builder_init(struct trigram_builder *b)
+{
+  pthread_mutex_init(&b->lock, NULL);
+  b->files = NULL;
+  b->num_files = 0;
+  b->cap = 0;
+}
+
+void trigram_builder_destroy(struct trigram_builder *b)
+{
+  for (size_t i = 0; i < b->num_files; i++)
+  {
+    free(b->files[i].path);
+    free(b->files[i].trigrams);
+  }
+  free(b->files);
+  pthread_mutex_destroy(&b->lock);
+}
+
+static int compare_built(const void *a, const void *b)
+{
+  long x = ((const struct trigram_built *)a)->id;
+  long y = ((const struct trigram_built *)b)->id;
+  return x < y ? -1 : x > y;
+}
+
+void trigram_builder_add(struct trigram_builder *b, long id, const char *path,
+                         const struct stat *st, struct trigram_set *t)
+{
+  trigram_builder_add_list(b, id, path, st, t->list, t->len);
+  trigram_set_clear(t);
+}
+
+void trigram_builder_add_list(struct trigram_builder *b, long id, const char *path,
+                              const struct stat *st, const uint32_t *trigrams, size_t len)
+{
+  struct trigram_built f;
+  f.id = id;
+  file_id_stat(&f.file, st);
+  f.num_trigrams = len;
+  f.path = strdup(path);
+  f.trigrams = malloc(len * sizeof(uint32_t) + 1);
+  if (f.path == NULL || f.trigrams == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  memcpy(f.trigrams, trigrams, len * sizeof(uint32_t));
+
+  pthread_mutex_lock(&b->lock);
+  if (b->num_files == b->cap)
+  {
+    b->cap = b->cap == 0 ? 1024 : b->cap * 2;
+    if ((b->files = realloc(b->files, b->cap * sizeof(struct trigram_built))) == NULL)
+    {
+      err(1, "realloc() failed");
+    }
+  }
+  b->files[b->num_files++] = f;
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void put_varint(struct io_buffer *out, uint32_t v)
+{
+  char bytes[5];
+  int n = 0;
+  while (v >= 0x80)
+  {
+    bytes[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  bytes[n++] = v;
+  io_buffer_append(out, bytes, n);
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint32_t *v)
+{
+  uint32_t x = 0;
+  int shift = 0;
+  while (*p & 0x80)
+  {
+    x |= (uint32_t)(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  *v = x | (uint32_t)*p++ << shift;
+  return p;
+}
+
+// Walks a posting list.
+struct posting_iter
+{
+  const uint8_t *p;
+  uint32_t left;
+  uint32_t id;
+};
+
+static int next_posting(struct posting_iter *it, uint32_t *id)
+{
+  if (it->left == 0)
+  {
+    return 0;
+  }
+  it->left--;
+
+  uint32_t delta;
+  it->p = get_varint(it->p, &delta);
+  *id = it->id += delta;
+  return 1;
+}
+
+static void write_all(FILE *f, const char *path, const void *data, size_t len)
+{
+  if (len > 0 && fwrite(data, len, 1, f) != 1)
+  {
+    err(1, "failed to write %s", path);
+  }
+}
+
+void trigram_builder_write(struct trigram_builder *b, const char *path, char *const *roots)
+{
+  // Number the files in the order they were found.
+  qsort(b->files, b->num_files, sizeof(struct trigram_built), compare_built);
+
+  struct trigram_file *files = calloc(b->num_files + 1, sizeof(struct trigram_file));
+  struct io_buffer paths = {NULL, 0, 0};
+  size_t num_pairs = 0;
+  if (files == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+  for (size_t i = 0; i < b->num_files; i++)
+  {
+    files[i].path = paths.len;
+    files[i].id = b->files[i].file;
+    io_buffer_append(&paths, b->files[i].path, strlen(b->files[i].path) + 1);
+    num_pairs += b->files[i].num_trigrams;
+  }
+
+  // Turn the trigrams of each file into the files of each trigram,
+  // with a counting sort.  Going through the files in order leaves
+  // each trigram's files in order too.
+  size_t *starts = calloc(TRIGRAM_SPACE + 1, sizeof(size_t));
+  uint32_t *ids = malloc(num_pairs * sizeof(uint32_t) + 1);
+  if (starts == NULL || ids == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  for (size_t i = 0; i < b->num_files; i++)
+  {
+    for (size_t j = 0; j < b->files[i].num_trigrams; j++)
+    {
+      starts[b->files[i].trigrams[j] + 1]++;
+    }
+  }
+  for (size_t t = 0; t < TRIGRAM_SPACE; t++)
+  {
+    starts[t + 1] += starts[t];
+  }
+  for (size_t i = 0; i < b->num_files; i++)
+  {
+    for (size_t j = 0; j < b->files[i].num_trigrams; j++)
+    {
+      ids[starts[b->files[i].trigrams[j]]++] = i;
+    }
+  }
+
+  // Each start has moved up to the next one's.
+  struct io_buffer trigrams = {NULL, 0, 0};
+  struct io_buffer postings = {NULL, 0, 0};
+  uint32_t num_trigrams = 0;
+  for (size_t t = 0, i = 0; t < TRIGRAM_SPACE; t++)
+  {
+    if (i == starts[t])
+    {
+      continue;
+    }
+
+    struct trigram_entry e = {t, starts[t] - i, postings.len};
+    uint32_t prev = 0;
+    for (; i < starts[t]; i++)
+    {
+      put_varint(&postings, ids[i] - prev);
+      prev = ids[i];
+    }
+    io_buffer_append(&trigrams, (const char *)&e, sizeof(e));
+    num_trigrams++;
+  }
+  free(starts);
+  free(ids);
+
+  struct io_buffer root_paths = {NULL, 0, 0};
+  uint32_t num_roots = 0;
+  for (; roots[num_roots] != NULL; num_roots++)
+  {
+    io_buffer_append(&root_paths, roots[num_roots], strlen(roots[num_roots]) + 1);
+  }
+
+  struct trigram_header h;
+  memcpy(h.magic, TRIGRAM_MAGIC, sizeof(h.magic));
+  h.num_files = b->num_files;
+  h.num_trigrams = num_trigrams;
+  h.num_roots = num_roots;
+  h.unused = 0;
+  h.files = sizeof(h);
+  h.trigrams = h.files + b->num_files * sizeof(struct trigram_file);
+  h.postings = h.trigrams + trigrams.len;
+  h.paths = h.postings + postings.len;
+  h.roots = h.paths + paths.len;
+
+  // Write it next to the old one, and only then replace that.
+  char *tmp;
+  if (asprintf(&tmp, "%s.tmp.%d", path, (int)getpid()) < 0)
+  {
+    err(1, "asprintf() failed");
+  }
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+  {
+    err(1, "failed to open %s", tmp);
+  }
+  write_all(f, tmp, &h, sizeof(h));
+  write_all(f, tmp, files, b->num_files * sizeof(struct trigram_file));
+  write_all(f, tmp, trigrams.data, trigrams.len);
+  write_all(f, tmp, postings.data, postings.len);
+  write_all(f, tmp, paths.data, paths.len);
+  write_all(f, tmp, root_paths.data, root_paths.len);
+  if (fclose(f) != 0)
+  {
+    err(1, "failed to write %s", tmp);
+  }
+  if (rename(tmp, path) != 0)
+  {
+    err(1, "failed to rename %s to %s", tmp, path);
+  }
+
+  free(tmp);
+  free(files);
+  io_buffer_free(&paths);
+  io_buffer_free(&root_paths);
+  io_buffer_free(&trigrams);
+  io_buffer_free(&postings);
+}
+
+void trigram_index_open(struct trigram_index *ix, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    err(1, "failed to open %s", path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    err(1, "failed to stat %s", path);
+  }
+  ix->size = st.st_size;
+  if (ix->size < sizeof(struct trigram_header))
+  {
+    errx(1, "%s is not an index", path);
+  }
+
+  void *map = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    err(1, "failed to map %s", path);
+  }
+  close(fd);
+
+  ix->map = map;
+  ix->header = map;
+  const struct trigram_header *h = ix->header;
+  if (memcmp(h->magic, TRIGRAM_MAGIC, sizeof(h->magic)) != 0 ||
+      h->files + (uint64_t)h->num_files * sizeof(struct trigram_file) > h->trigrams ||
+      h->trigrams + (uint64_t)h->num_trigrams * sizeof(struct trigram_entry) > h->postings ||
+      h->postings > h->paths || h->paths > h->roots || h->roots > ix->size ||
+      (h->paths < ix->size && ix->map[ix->size - 1] != '\0'))
+  {
+    errx(1, "%s is not an index", path);
+  }
+
+  ix->files = (const struct trigram_file *)(ix->map + h->files);
+  ix->trigrams = (const struct trigram_entry *)(ix->map + h->trigrams);
+  ix->postings = (const uint8_t *)ix->map + h->postings;
+  ix->paths = ix->map + h->paths;
+  ix->by_path = NULL;
+}
+
+void trigram_index_close(struct trigram_index *ix)
+{
+  free(ix->by_path);
+  munmap((void *)ix->map, ix->size);
+}
+
+char **trigram_index_roots(const struct trigram_index *ix)
+{
+  uint32_t num_roots = ix->header->num_roots;
+  char **roots = calloc(num_roots + 1, sizeof(char *));
+  if (roots == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+
+  const char *p = ix->map + ix->header->roots;
+  for (uint32_t i = 0; i < num_roots && p < ix->map + ix->size; i++)
+  {
+    roots[i] = (char *)p;
+    p += strlen(p) + 1;
+  }
+  return roots;
+}
+
+static int compare_paths(const void *a, const void *b, void *arg)
+{
+  const struct trigram_index *ix = arg;
+  return strcmp(trigram_index_path(ix, *(const uint32_t *)a),
+                trigram_index_path(ix, *(const uint32_t *)b));
+}
+
+long trigram_index_find(struct trigram_index *ix, const char *path)
+{
+  uint32_t num_files = ix->header->num_files;
+  if (ix->by_path == NULL)
+  {
+    if ((ix->by_path = malloc(num_files * sizeof(uint32_t) + 1)) == NULL)
+    {
+      err(1, "malloc() failed");
+    }
+    for (uint32_t i = 0; i < num_files; i++)
+    {
+      ix->by_path[i] = i;
+    }
+    qsort_r(ix->by_path, num_files, sizeof(uint32_t), compare_paths, ix);
+  }
+
+  size_t lo = 0;
+  size_t hi = num_files;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(trigram_index_path(ix, ix->by_path[mid]), path);
+    if (cmp == 0)
+    {
+      return ix->by_path[mid];
+    }
+    if (cmp < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+uint32_t *trigram_index_by_file(const struct trigram_index *ix, size_t *starts)
+{
+  uint32_t num_files = ix->header->num_files;
+  uint32_t num_trigrams = ix->header->num_trigrams;
+
+  // Another counting sort, this time by file.
+  memset(starts, 0, (num_files + 1) * sizeof(size_t));
+  for (uint32_t t = 0; t < num_trigrams; t++)
+  {
+    struct posting_iter it = {ix->postings + ix->trigrams[t].postings, ix->trigrams[t].count, 0};
+    uint32_t id;
+    while (next_posting(&it, &id) && id < num_files)
+    {
+      starts[id + 1]++;
+    }
+  }
+  for (uint32_t i = 0; i < num_files; i++)
+  {
+    starts[i + 1] += starts[i];
+  }
+
+  uint32_t *list = malloc(starts[num_files] * sizeof(uint32_t) + 1);
+  if (list == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  for (uint32_t t = 0; t < num_trigrams; t++)
+  {
+    struct posting_iter it = {ix->postings + ix->trigrams[t].postings, ix->trigrams[t].count, 0};
+    uint32_t id;
+    while (next_posting(&it, &id) && id < num_files)
+    {
+      list[starts[id]++] = ix->trigrams[t].trigram;
+    }
+  }
+
+  // Each start has moved up to the next one's.
+  memmove(starts + 1, starts, num_files * sizeof(size_t));
+  starts[0] = 0;
+  return list;
+}
+
+static const struct trigram_entry *find_trigram(const struct trigram_index *ix, uint32_t trigram)
+{
+  size_t lo = 0;
+  size_t hi = ix->header->num_trigrams;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ix->trigrams[mid].trigram < trigram)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo < ix->header->num_trigrams && ix->trigrams[lo].trigram == trigram ? &ix->trigrams[lo]
+                                                                             : NULL;
+}
+
+void trigram_index_candidates(const struct trigram_index *ix, const char *s, size_t len,
+                              char *wanted)
+{
+  uint32_t num_files = ix->header->num_files;
+  if (len < 3)
+  {
+    memset(wanted, 1, num_files);
+    return;
+  }
+
+  // Every trigram must be there, so start from the rarest one, and
+  // keep only the files that the others have too.
+  size_t num = len - 2;
+  const struct trigram_entry **entries = malloc(num * sizeof(*entries));
+  if (entries == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  size_t rarest = 0;
+  for (size_t i = 0; i < num; i++)
+  {
+    uint32_t trigram = (uint32_t)fold_byte(s[i]) << 16 | (uint32_t)fold_byte(s[i + 1]) << 8 |
+                       fold_byte(s[i + 2]);
+    if ((entries[i] = find_trigram(ix, trigram)) == NULL)
+    {
+      free(entries);
+      return;
+    }
+    if (entries[i]->count < entries[rarest]->count)
+    {
+      rarest = i;
+    }
+  }
+
+  uint32_t *ids = malloc(entries[rarest]->count * sizeof(uint32_t) + 1);
+  if (ids == NULL)
+  {
+    err(1, "malloc() failed");
+  }
+  struct posting_iter it = {ix->postings + entries[rarest]->postings, entries[rarest]->count, 0};
+  uint32_t num_ids = 0;
+  while (next_posting(&it, &ids[num_ids]))
+  {
+    num_ids++;
+  }
+
+  for (size_t i = 0; i < num && num_ids > 0; i++)
+  {
+    if (i == rarest)
+    {
+      continue;
+    }
+
+    struct posting_iter other = {ix->postings + entries[i]->postings, entries[i]->count, 0};
+    uint32_t kept = 0;
+    uint32_t j = 0;
+    uint32_t id;
+    while (j < num_ids && next_posting(&other, &id))
+    {
+      while (j < num_ids && ids[j] < id)
+      {
+        j++;
+      }
+      if (j < num_ids && ids[j] == id)
+      {
+        ids[kept++] = id;
+        j++;
+      }
+    }
+    num_ids = kept;
+  }
+
+  for (uint32_t i = 0; i < num_ids; i++)
+  {
+    if (ids[i] < num_files)
+    {
+      wanted[ids[i]] = 1;
+    }
+  }
+  free(ids);
+  free(entries);
+}
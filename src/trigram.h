@@ -0,0 +1,161 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+// An index of the trigrams (three byte sequences) in a set of files, to
+// tell which files can possibly contain a string: those that contain
+// every trigram of it.  Those are then searched as usual.
+//
+// Each file's device, inode, size and modification time are recorded
+// too.  A file for which any of those has changed since is searched
+// whether it may match or not, so results are exact for every file in
+// the index.  Updating the index walks the same paths again, and only
+// reads the files that are new or have changed.
+//
+// Trigrams are taken with ASCII letters folded to lower case, so the
+// same index serves case-insensitive searches.
+//
+// The index file is written once and mapped read-only.  It holds a
+// header, a table of files, a sorted table of trigrams, their posting
+// lists, the paths of the files and the paths they were found under.
+// A posting list is the ids of the files that
+// have the trigram, in increasing order, stored as the differences
+// between them in LEB128 varints.  File ids are the order in which the
+// files were found.
+
+#define TRIGRAM_MAGIC "FGTRI002"
+
+// A trigram is three bytes, the first one highest.
+#define TRIGRAM_SPACE (1 << 24)
+
+struct trigram_header
+{
+  char magic[8];
+  uint32_t num_files;
+  uint32_t num_trigrams;
+  uint32_t num_roots;
+  uint32_t unused;
+  uint64_t files;    // Offset of struct trigram_file[num_files].
+  uint64_t trigrams; // Offset of struct trigram_entry[num_trigrams].
+  uint64_t postings; // Offset of the posting lists.
+  uint64_t paths;    // Offset of the paths, each NUL terminated.
+  uint64_t roots;    // Offset of the paths walked, likewise.
+};
+
+struct trigram_file
+{
+  uint64_t path; // Offset from the start of the paths.
+  struct file_id id;
+};
+
+struct trigram_entry
+{
+  uint32_t trigram;
+  uint32_t count;    // Files in the posting list.
+  uint64_t postings; // Offset from the start of the posting lists.
+};
+
+// The trigrams of one file, collected a block at a time.  A bitmap of
+// all possible trigrams tells which we have seen; it is 2 MB, so each
+// thread keeps one for all its files.
+struct trigram_set
+{
+  uint8_t *seen;
+  uint32_t *list; // The trigrams seen, in the order seen.
+  size_t len;
+  size_t cap;
+  uint32_t last; // The last two bytes, for trigrams that cross blocks.
+  size_t bytes;  // Bytes added so far.
+};
+
+void trigram_set_init(struct trigram_set *t);
+
+void trigram_set_destroy(struct trigram_set *t);
+
+// Add the next 'len' bytes of the file.
+void trigram_set_add(struct trigram_set *t, const char *buf, size_t len);
+
+// Forget the trigrams seen, to start on the next file.
+void trigram_set_clear(struct trigram_set *t);
+
+// Collects the trigram sets of all files, from several threads.
+struct trigram_builder
+{
+  pthread_mutex_t lock;
+  struct trigram_built *files;
+  size_t num_files;
+  size_t cap;
+};
+
+void trigram_builder_init(struct trigram_builder *b);
+
+void trigram_builder_destroy(struct trigram_builder *b);
+
+// Add the file with id 'id', and empty 't' for the next one.
+void trigram_builder_add(struct trigram_builder *b, long id, const char *path,
+                         const struct stat *st, struct trigram_set *t);
+
+// Add a file whose trigrams are known.
+void trigram_builder_add_list(struct trigram_builder *b, long id, const char *path,
+                              const struct stat *st, const uint32_t *trigrams, size_t len);
+
+// Write the index of the files found under 'roots', replacing 'path'
+// only once it is complete.  Exits with an error message on failure.
+void trigram_builder_write(struct trigram_builder *b, const char *path, char *const *roots);
+
+struct trigram_index
+{
+  const char *map;
+  size_t size;
+  const struct trigram_header *header;
+  const struct trigram_file *files;
+  const struct trigram_entry *trigrams;
+  const uint8_t *postings;
+  const char *paths;
+
+  // File ids sorted by path, for trigram_index_find().
+  uint32_t *by_path;
+};
+
+// Map an index.  Exits with an error message if it is not a valid one.
+void trigram_index_open(struct trigram_index *ix, const char *path);
+
+void trigram_index_close(struct trigram_index *ix);
+
+static inline uint32_t trigram_index_num_files(const struct trigram_index *ix)
+{
+  return ix->header->num_files;
+}
+
+static inline const char *trigram_index_path(const struct trigram_index *ix, uint32_t id)
+{
+  return ix->paths + ix->files[id].path;
+}
+
+// The paths walked to build the index, NULL terminated.  Free the
+// array with free().
+char **trigram_index_roots(const struct trigram_index *ix);
+
+// Find a file by path.  Returns its id, or -1 if it is not indexed.
+// The first call sorts the paths, which takes a while.
+long trigram_index_find(struct trigram_index *ix, const char *path);
+
+// The trigrams of every file, as the posting lists turned inside out.
+// Those of file 'id' are list[starts[id]] up to list[starts[id + 1]].
+// 'starts' needs room for one more entry than there are files.  Free
+// the list with free().
+uint32_t *trigram_index_by_file(const struct trigram_index *ix, size_t *starts);
+
+// Set 'wanted[id]' for every file that may contain 's'.  Strings
+// shorter than a trigram may be in any file.
+void trigram_index_candidates(const struct trigram_index *ix, const char *s, size_t len,
+                              char *wanted);
+
+#endif
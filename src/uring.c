@@ -0,0 +1,366 @@
+// Setting _GNU_SOURCE is necessary to activate visibility of
+// certain header file contents (such as O_DIRECT) on GNU/Linux systems.
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "file_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(u, 0, sizeof(*u));
+
+  u->fd = sys_io_uring_setup(entries, &p);
+  if (u->fd < 0)
+  {
+    return -1;
+  }
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels let both rings live in a single mapping.
+  int single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && u->cq_ring_size > u->sq_ring_size)
+  {
+    u->sq_ring_size = u->cq_ring_size;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+  {
+    close(u->fd);
+    return -1;
+  }
+
+  if (single_mmap)
+  {
+    u->cq_ring = u->sq_ring;
+  }
+  else
+  {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+    {
+      munmap(u->sq_ring, u->sq_ring_size);
+      close(u->fd);
+      return -1;
+    }
+  }
+
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                 IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+  {
+    if (u->cq_ring != u->sq_ring)
+    {
+      munmap(u->cq_ring, u->cq_ring_size);
+    }
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    return -1;
+  }
+
+  char *sq = u->sq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+  char *cq = u->cq_ring;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void uring_destroy(struct uring *u)
+{
+  munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != u->sq_ring)
+  {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
+
+// Grab the next free submission entry.  The callers never have more
+// requests outstanding than there are entries, so this cannot fail.
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+  unsigned tail = *u->sq_tail;
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+
+  return sqe;
+}
+
+// Check that the kernel knows all the operations we are going to use.
+// Kernels older than 5.6 have no IORING_OP_OPENAT or IORING_OP_READ.
+static int uring_supported(struct uring *u)
+{
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL)
+  {
+    return 0;
+  }
+
+  int ok = sys_io_uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED};
+  for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+  {
+    ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  free(probe);
+  return ok;
+}
+
+int uring_reader_init(struct uring_reader *r, unsigned depth, size_t block_size,
+                      uring_data_fn data, uring_done_fn done)
+{
+  memset(r, 0, sizeof(*r));
+
+  if (uring_init(&r->ring, depth) != 0)
+  {
+    return -1;
+  }
+
+  if (!uring_supported(&r->ring))
+  {
+    uring_destroy(&r->ring);
+    return -1;
+  }
+
+  r->depth = depth;
+  r->block_size = block_size;
+  r->data = data;
+  r->done = done;
+
+  r->slots = calloc(depth, sizeof(struct uring_slot));
+  r->free_slots = calloc(depth, sizeof(unsigned));
+  r->buffers = mmap(NULL, depth * block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  if (r->slots == NULL || r->free_slots == NULL || r->buffers == MAP_FAILED)
+  {
+    free(r->slots);
+    free(r->free_slots);
+    if (r->buffers != MAP_FAILED)
+    {
+      munmap(r->buffers, depth * block_size);
+    }
+    uring_destroy(&r->ring);
+    return -1;
+  }
+
+  for (unsigned i = 0; i < depth; i++)
+  {
+    r->free_slots[i] = depth - 1 - i;
+  }
+  r->num_free = depth;
+
+  // Registering the buffers saves the kernel from mapping them on
+  // every read.  It may fail if RLIMIT_MEMLOCK is small, in which case
+  // we simply fall back to ordinary reads into the same buffers.
+  struct iovec *iovecs = calloc(depth, sizeof(struct iovec));
+  if (iovecs != NULL)
+  {
+    for (unsigned i = 0; i < depth; i++)
+    {
+      iovecs[i].iov_base = r->buffers + i * block_size;
+      iovecs[i].iov_len = block_size;
+    }
+    r->fixed_buffers =
+      sys_io_uring_register(r->ring.fd, IORING_REGISTER_BUFFERS, iovecs, depth) == 0;
+    free(iovecs);
+  }
+
+  return 0;
+}
+
+void uring_reader_destroy(struct uring_reader *r)
+{
+  uring_destroy(&r->ring);
+  munmap(r->buffers, r->depth * r->block_size);
+  free(r->slots);
+  free(r->free_slots);
+}
+
+int uring_reader_full(struct uring_reader *r)
+{
+  return r->num_free == 0;
+}
+
+int uring_reader_empty(struct uring_reader *r)
+{
+  return r->num_free == r->depth;
+}
+
+static void reader_queue_read(struct uring_reader *r, unsigned index)
+{
+  struct uring_slot *slot = &r->slots[index];
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+
+  sqe->opcode = r->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (uintptr_t)(r->buffers + index * r->block_size);
+  sqe->len = r->block_size;
+  sqe->off = slot->offset;
+  sqe->buf_index = index;
+  sqe->user_data = index;
+}
+
+static void reader_queue_open(struct uring_reader *r, unsigned index)
+{
+  struct uring_slot *slot = &r->slots[index];
+  struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)slot->path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC | (slot->mode == FILE_DIRECT ? O_DIRECT : 0);
+  sqe->user_data = index;
+}
+
+void uring_reader_add(struct uring_reader *r, const char *path, int fd, off_t offset, int mode,
+                      void *arg)
+{
+  unsigned index = r->free_slots[--r->num_free];
+  struct uring_slot *slot = &r->slots[index];
+
+  slot->arg = arg;
+  slot->path = path;
+  slot->fd = fd;
+  slot->offset = offset;
+  slot->mode = mode;
+  slot->dropped = offset;
+
+  if (fd >= 0)
+  {
+    reader_queue_read(r, index);
+  }
+  else
+  {
+    reader_queue_open(r, index);
+  }
+}
+
+static void reader_finish(struct uring_reader *r, unsigned index, int error)
+{
+  struct uring_slot *slot = &r->slots[index];
+
+  int opened = slot->fd >= 0;
+  if (opened)
+  {
+    if (slot->mode == FILE_DROP_BEHIND)
+    {
+      file_drop_behind(slot->fd, &slot->dropped, -1);
+    }
+    close(slot->fd);
+  }
+  r->free_slots[r->num_free++] = index;
+  r->done(slot->arg, error, opened);
+}
+
+static void reader_complete(struct uring_reader *r, unsigned index, int res)
+{
+  struct uring_slot *slot = &r->slots[index];
+
+  if (res == -EINVAL && slot->fd < 0 && slot->mode == FILE_DIRECT)
+  {
+    // No O_DIRECT on this file system; settle for dropping the pages
+    // as we go.
+    slot->mode = FILE_DROP_BEHIND;
+    reader_queue_open(r, index);
+  }
+  else if (res < 0)
+  {
+    reader_finish(r, index, -res);
+  }
+  else if (slot->fd < 0)
+  {
+    // The open finished; start reading.
+    slot->fd = res;
+    reader_queue_read(r, index);
+  }
+  else if (res == 0 || r->data(slot->arg, r->buffers + index * r->block_size, res) != 0)
+  {
+    reader_finish(r, index, 0);
+  }
+  else
+  {
+    slot->offset += res;
+    if (slot->mode == FILE_DROP_BEHIND)
+    {
+      file_drop_behind(slot->fd, &slot->dropped, slot->offset);
+    }
+    reader_queue_read(r, index);
+  }
+}
+
+int uring_reader_run(struct uring_reader *r)
+{
+  struct uring *u = &r->ring;
+
+  int ret = sys_io_uring_enter(u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS);
+  if (ret < 0)
+  {
+    return errno == EINTR ? 0 : -1;
+  }
+  u->to_submit -= ret;
+
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+  {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    unsigned index = cqe->user_data;
+    int res = cqe->res;
+
+    // Hand the entry back before handling it, as handling it may
+    // queue up new requests.
+    head++;
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    reader_complete(r, index, res);
+  }
+
+  return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+
+// A minimal io_uring wrapper that talks to the kernel through the raw
+// system calls, so we do not depend on liburing being installed.
+struct uring
+{
+  int fd;
+
+  // Submission queue, shared with the kernel.
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned to_submit;
+
+  // Completion queue, shared with the kernel.
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+// Called with each block read from a file, in file order.  Returning
+// non-zero stops reading the file early.
+typedef int (*uring_data_fn)(void *arg, const char *buf, size_t len);
+
+// Called exactly once per file, after the last block has been handed
+// to the data function.  'error' is non-zero if the file could not be
+// opened or read, and 'opened' tells which.
+typedef void (*uring_done_fn)(void *arg, int error, int opened);
+
+struct uring_slot
+{
+  void *arg;
+  const char *path;
+  int fd;
+  off_t offset;
+  int mode;
+  off_t dropped;
+};
+
+// Keeps up to 'depth' files in flight at once.  Every slot owns one
+// block-sized buffer which is registered with the kernel, and a slot
+// only ever has a single open or read outstanding.
+struct uring_reader
+{
+  struct uring ring;
+  unsigned depth;
+  size_t block_size;
+  int fixed_buffers;
+
+  struct uring_slot *slots;
+  unsigned *free_slots;
+  unsigned num_free;
+  char *buffers;
+
+  uring_data_fn data;
+  uring_done_fn done;
+};
+
+// Set up a reader.  Returns non-zero if io_uring is not available on
+// this system (old kernel, disabled by sysctl, blocked by seccomp,
+// ...), in which case the caller should use plain blocking I/O.
+int uring_reader_init(struct uring_reader *r, unsigned depth, size_t block_size,
+                      uring_data_fn data, uring_done_fn done);
+
+void uring_reader_destroy(struct uring_reader *r);
+
+// Non-zero if no more files can be added right now.
+int uring_reader_full(struct uring_reader *r);
+
+// Non-zero if no files are in flight.
+int uring_reader_empty(struct uring_reader *r);
+
+// Queue 'path' for reading from 'offset' to the end.  Must not be
+// called when the reader is full.  The path must stay valid until the
+// done function is called.  If 'fd' is not -1 the file has already been
+// opened, and the reader takes over the descriptor.  'mode' is one of
+// the file_cache_mode values from file_io.h.
+void uring_reader_add(struct uring_reader *r, const char *path, int fd, off_t offset, int mode,
+                      void *arg);
+
+// Submit queued requests, then wait for and handle at least one
+// completion.  Returns non-zero on error.
+int uring_reader_run(struct uring_reader *r);
+
+#endif
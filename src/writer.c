@@ -0,0 +1,195 @@
+#include "writer.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+static void *writer_thread(void *arg)
+{
+  struct writer *w = arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (1)
+  {
+    while (w->head == NULL && !w->closing)
+    {
+      pthread_cond_wait(&w->ready, &w->lock);
+    }
+    if (w->head == NULL)
+    {
+      break;
+    }
+
+    // Take the first few buffers, and write them without the lock, so
+    // the producers can carry on queuing.
+    struct writer_buf *batch = w->head;
+    struct writer_buf *last = batch;
+    for (int i = 1; i < WRITER_BATCH && last->next != NULL; i++)
+    {
+      last = last->next;
+    }
+    w->head = last->next;
+    if (w->head == NULL)
+    {
+      w->tail = NULL;
+    }
+    last->next = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    struct iovec iov[WRITER_BATCH];
+    int iovcnt = 0;
+    size_t bytes = 0;
+    for (struct writer_buf *b = batch; b != NULL; b = b->next)
+    {
+      iov[iovcnt++] = (struct iovec){b->buf.data, b->buf.len};
+      bytes += b->buf.len;
+    }
+    // Once a write has failed, the rest is only thrown away.
+    if (w->error == 0)
+    {
+      __atomic_store_n(&w->error, file_writev(w->fd, iov, iovcnt), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (batch != NULL)
+    {
+      struct writer_buf *b = batch;
+      batch = b->next;
+      if (w->num_free < WRITER_MAX_FREE)
+      {
+        b->buf.len = 0;
+        b->next = w->free_bufs;
+        w->free_bufs = b;
+        w->num_free++;
+      }
+      else
+      {
+        io_buffer_free(&b->buf);
+        free(b);
+      }
+    }
+    w->queued -= bytes;
+    pthread_cond_broadcast(&w->room);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+void writer_init(struct writer *w, int fd, size_t limit)
+{
+  w->fd = fd;
+  w->limit = limit;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->ready, NULL);
+  pthread_cond_init(&w->room, NULL);
+  w->head = w->tail = NULL;
+  w->queued = 0;
+  w->free_bufs = NULL;
+  w->num_free = 0;
+  w->closing = 0;
+  w->error = 0;
+
+  if (pthread_create(&w->thread, NULL, writer_thread, w) != 0)
+  {
+    err(1, "pthread_create() failed");
+  }
+}
+
+void writer_destroy(struct writer *w)
+{
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+
+  if (pthread_join(w->thread, NULL) != 0)
+  {
+    err(1, "pthread_join() failed");
+  }
+
+  while (w->free_bufs != NULL)
+  {
+    struct writer_buf *b = w->free_bufs;
+    w->free_bufs = b->next;
+    io_buffer_free(&b->buf);
+    free(b);
+  }
+  pthread_cond_destroy(&w->room);
+  pthread_cond_destroy(&w->ready);
+  pthread_mutex_destroy(&w->lock);
+}
+
+// With the lock held, wait until 'len' more bytes may be queued, and
+// get a buffer for them.
+static struct writer_buf *writer_take(struct writer *w, size_t len)
+{
+  // Something is always being written while we wait, so this ends
+  // once that write does, however long the reader takes over it.
+  while (w->queued > 0 && w->queued + len > w->limit)
+  {
+    pthread_cond_wait(&w->room, &w->lock);
+  }
+
+  struct writer_buf *wb = w->free_bufs;
+  if (wb != NULL)
+  {
+    w->free_bufs = wb->next;
+    w->num_free--;
+  }
+  else if ((wb = calloc(1, sizeof(*wb))) == NULL)
+  {
+    err(1, "calloc() failed");
+  }
+  return wb;
+}
+
+// With the lock held, queue a filled buffer.
+static void writer_queue(struct writer *w, struct writer_buf *wb)
+{
+  wb->next = NULL;
+  if (w->tail != NULL)
+  {
+    w->tail->next = wb;
+  }
+  else
+  {
+    w->head = wb;
+  }
+  w->tail = wb;
+  w->queued += wb->buf.len;
+  pthread_cond_signal(&w->ready);
+}
+
+void writer_submit(struct writer *w, struct io_buffer *b)
+{
+  if (b->len == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  struct writer_buf *wb = writer_take(w, b->len);
+
+  // Swap buffers, so the caller gets an empty one to carry on with.
+  struct io_buffer empty = wb->buf;
+  wb->buf = *b;
+  *b = empty;
+
+  writer_queue(w, wb);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void writer_write(struct writer *w, const char *data, size_t len)
+{
+  if (len == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  struct writer_buf *wb = writer_take(w, len);
+  io_buffer_append(&wb->buf, data, len);
+  writer_queue(w, wb);
+  pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,70 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "file_io.h"
+
+// A thread that writes buffers of output to a file descriptor, so that
+// the threads producing the output can go on while a slow reader on
+// the other end of a pipe catches up.
+//
+// Producers hand over a filled buffer and get an empty one back in
+// exchange, so buffers go round between them and the writer and are
+// reused rather than allocated.  The queue is a list under a mutex,
+// which producers only hold long enough to link a buffer in.  They do
+// block, though: once more than 'limit' bytes are waiting to be
+// written, writer_submit() and writer_write() wait until the writer
+// has caught up that far, so a reader that stops reading stops the
+// producers too, rather than letting the queue grow without bound.
+
+// Buffers are written this many at a time, with one writev().
+#define WRITER_BATCH 64
+
+// Empty buffers kept for reuse beyond this many are freed.
+#define WRITER_MAX_FREE 64
+
+struct writer_buf
+{
+  struct writer_buf *next;
+  struct io_buffer buf;
+};
+
+struct writer
+{
+  int fd;
+  size_t limit;
+  pthread_t thread;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // Something to write, or closing.
+  pthread_cond_t room;  // Fewer bytes queued.
+
+  struct writer_buf *head; // Queue of buffers to write.
+  struct writer_buf *tail;
+  size_t queued; // Bytes in the queue, and being written.
+  struct writer_buf *free_bufs;
+  int num_free;
+  int closing;
+
+  // The errno value of the first write that failed, after which
+  // nothing more is written.
+  int error;
+};
+
+// Start the writer thread.  The producers should watch 'error', and
+// stop once it is set.
+void writer_init(struct writer *w, int fd, size_t limit);
+
+// Write out everything still queued, and stop the thread.
+void writer_destroy(struct writer *w);
+
+// Queue the contents of 'b' to be written, leaving 'b' empty.  Waits
+// first while the queue is over its limit.
+void writer_submit(struct writer *w, struct io_buffer *b);
+
+// Queue a copy of 'data', waiting the same way.
+void writer_write(struct writer *w, const char *data, size_t len);
+
+#endif